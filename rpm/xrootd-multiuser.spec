@@ -68,6 +68,7 @@ rm -rf $RPM_BUILD_ROOT
 %files
 %defattr(-,root,root,-)
 %{_libdir}/libXrdMultiuser-*.so
+%{_bindir}/xrootd-multiuser-idmap
 %{_unitdir}/cmsd-privileged@.service
 %{_unitdir}/xrootd-privileged@.service
 %{_sysconfdir}/xrootd/config.d/60-osg-multiuser.cfg
@@ -0,0 +1,100 @@
+#include "CachePolicy.hh"
+#include "WriteBuffer.hh"
+
+#include <fcntl.h>
+
+const off_t CachePolicy::m_chunk;
+bool CachePolicy::m_enabled = false;
+size_t CachePolicy::m_min_size = 64 * 1024 * 1024;
+std::atomic<unsigned long long> CachePolicy::m_files{0};
+std::atomic<unsigned long long> CachePolicy::m_bytes_read{0};
+std::atomic<unsigned long long> CachePolicy::m_bytes_written{0};
+std::atomic<unsigned long long> CachePolicy::m_read_dropped_bytes{0};
+std::atomic<unsigned long long> CachePolicy::m_write_dropped_bytes{0};
+std::atomic<unsigned long long> CachePolicy::m_checksum_bytes{0};
+std::atomic<unsigned long long> CachePolicy::m_checksum_dropped_bytes{0};
+
+
+CachePolicy::CachePolicy(int fd, bool reading, Kind kind) :
+    m_fd(fd),
+    m_kind(kind)
+{
+    if (kind == Transfer) {m_files++;}
+    if (reading) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+    }
+}
+
+
+void
+CachePolicy::OnRead(off_t offset, size_t size)
+{
+    if (m_fd < 0) {return;}
+    ((m_kind == Checksum) ? m_checksum_bytes : m_bytes_read) += size;
+
+    std::lock_guard<std::mutex> guard(m_mutex);
+    off_t end = offset + size;
+    if (offset != m_read_next) {
+        // A new run; whatever the previous one left is not ours to drop.
+        m_read_dropped = offset;
+    }
+    m_read_next = end;
+
+    off_t stop = end - m_chunk;
+    if (stop - m_read_dropped < m_chunk) {return;}
+    stop -= stop % m_chunk;
+    if (stop <= m_read_dropped) {return;}
+    if (!posix_fadvise(m_fd, m_read_dropped, stop - m_read_dropped, POSIX_FADV_DONTNEED)) {
+        ((m_kind == Checksum) ? m_checksum_dropped_bytes : m_read_dropped_bytes) += stop - m_read_dropped;
+    }
+    m_read_dropped = stop;
+}
+
+
+void
+CachePolicy::OnWrite(off_t offset, size_t size)
+{
+    if (m_fd < 0) {return;}
+    m_bytes_written += size;
+
+    std::lock_guard<std::mutex> guard(m_mutex);
+    off_t end = offset + size;
+    if (offset != m_write_next) {
+        m_write_started = m_write_dropped = offset;
+    }
+    m_write_next = end;
+
+    // Data still sitting in the write-behind buffer has not reached the page
+    // cache yet.
+    off_t limit = end - m_chunk - static_cast<off_t>(WriteBuffer::GetSize());
+    while (limit - m_write_started >= m_chunk) {
+        sync_file_range(m_fd, m_write_started, m_chunk, SYNC_FILE_RANGE_WRITE);
+        m_write_started += m_chunk;
+    }
+    // Writeback of these started a chunk ago; wait for it to finish so the
+    // pages are clean and can be dropped.
+    while (m_write_started - m_write_dropped >= 2 * m_chunk) {
+        if (!sync_file_range(m_fd, m_write_dropped, m_chunk,
+                             SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) &&
+            !posix_fadvise(m_fd, m_write_dropped, m_chunk, POSIX_FADV_DONTNEED))
+        {
+            m_write_dropped_bytes += m_chunk;
+        }
+        m_write_dropped += m_chunk;
+    }
+}
+
+
+void
+CachePolicy::Stats(std::ostream &os)
+{
+    os << "<cachepolicy><files>" << m_files.load()
+       << "</files><read>" << m_bytes_read.load()
+       << "</read><read_dropped>" << m_read_dropped_bytes.load()
+       << "</read_dropped><written>" << m_bytes_written.load()
+       << "</written><write_dropped>" << m_write_dropped_bytes.load()
+       << "</write_dropped><checksum_read>" << m_checksum_bytes.load()
+       << "</checksum_read><checksum_dropped>" << m_checksum_dropped_bytes.load()
+       << "</checksum_dropped></cachepolicy>";
+}
@@ -0,0 +1,84 @@
+#ifndef __MULTIUSERCACHEPOLICY_HH__
+#define __MULTIUSERCACHEPOLICY_HH__
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+
+#include <sys/types.h>
+
+
+/**
+ * Page cache policy for large streaming transfers (multiuser.cachepolicy).
+ *
+ * Files of at least the configured size, and the whole-file reads done to
+ * calculate checksums, would otherwise fill the page cache with data which
+ * is not read again and push out the small, hot files of other users.  For
+ * those files:
+ *
+ *  - opening for reading advises POSIX_FADV_SEQUENTIAL and NOREUSE;
+ *  - sequential reads drop what is well behind the cursor (DONTNEED);
+ *  - sequential writes start writeback of each completed chunk behind the
+ *    cursor (sync_file_range) and, one chunk later, wait for it and drop
+ *    it, since dirty pages cannot be dropped.
+ *
+ * Smaller files keep the normal caching behavior.  Counters for the bytes
+ * handled and dropped are reported through the OSS statistics.
+ */
+class CachePolicy {
+public:
+    enum Kind {
+        Transfer,
+        Checksum
+    };
+
+    static void Configure(bool enabled, size_t min_size)
+    {
+        m_enabled = enabled;
+        m_min_size = min_size;
+    }
+    static bool IsEnabled() {return m_enabled;}
+    static size_t GetMinimumSize() {return m_min_size;}
+    // Whether a file which is or will be `size` bytes long is managed.
+    static bool Applies(long long size) {return m_enabled && (size >= static_cast<long long>(m_min_size));}
+
+    static void Stats(std::ostream &os);
+
+    CachePolicy(int fd, bool reading, Kind kind);
+
+    // Record a completed read or write and act on the range behind it.
+    void OnRead(off_t offset, size_t size);
+    void OnWrite(off_t offset, size_t size);
+
+private:
+    CachePolicy(const CachePolicy &) = delete;
+    CachePolicy &operator=(const CachePolicy &) = delete;
+
+    // Ranges are handled in chunks this large, leaving at least one chunk
+    // (plus a write-behind buffer) untouched behind the cursor.
+    static const off_t m_chunk = 8 * 1024 * 1024;
+
+    int m_fd;
+    Kind m_kind;
+
+    std::mutex m_mutex;
+    off_t m_read_next{0};
+    off_t m_read_dropped{0};
+    off_t m_write_next{0};
+    off_t m_write_started{0};
+    off_t m_write_dropped{0};
+
+    static bool m_enabled;
+    static size_t m_min_size;
+
+    static std::atomic<unsigned long long> m_files;
+    static std::atomic<unsigned long long> m_bytes_read;
+    static std::atomic<unsigned long long> m_bytes_written;
+    static std::atomic<unsigned long long> m_read_dropped_bytes;
+    static std::atomic<unsigned long long> m_write_dropped_bytes;
+    static std::atomic<unsigned long long> m_checksum_bytes;
+    static std::atomic<unsigned long long> m_checksum_dropped_bytes;
+};
+
+#endif
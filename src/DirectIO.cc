@@ -0,0 +1,261 @@
+#include "DirectIO.hh"
+
+#include "XrdOss/XrdOss.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const size_t DirectIO::m_pool_align;
+const size_t DirectIO::m_bounce_size;
+const size_t DirectIO::m_max_idle_buffers;
+bool DirectIO::m_enabled = false;
+size_t DirectIO::m_min_size = 0;
+std::vector<std::string> DirectIO::m_prefixes;
+std::mutex DirectIO::m_pool_mutex;
+std::vector<char *> DirectIO::m_pool;
+
+
+DirectIO::Bounce::Bounce() :
+    m_data(nullptr)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_pool_mutex);
+        if (!m_pool.empty()) {
+            m_data = m_pool.back();
+            m_pool.pop_back();
+            return;
+        }
+    }
+    void *data;
+    if (!posix_memalign(&data, m_pool_align, m_bounce_size)) {m_data = static_cast<char *>(data);}
+}
+
+
+DirectIO::Bounce::~Bounce()
+{
+    if (!m_data) {return;}
+    {
+        std::lock_guard<std::mutex> guard(m_pool_mutex);
+        if (m_pool.size() < m_max_idle_buffers) {
+            m_pool.push_back(m_data);
+            return;
+        }
+    }
+    free(m_data);
+}
+
+
+bool
+DirectIO::IsEligible(const char *path, long long size)
+{
+    if (!m_enabled) {return false;}
+    if (m_min_size && ((size < 0) || (static_cast<size_t>(size) < m_min_size))) {return false;}
+    if (m_prefixes.empty()) {return true;}
+    for (const auto &prefix : m_prefixes) {
+        if (strncmp(path, prefix.c_str(), prefix.size())) {continue;}
+        char next = path[prefix.size()];
+        if (!next || (next == '/') || (prefix.back() == '/')) {return true;}
+    }
+    return false;
+}
+
+
+DirectIO::~DirectIO()
+{
+    if (m_fd >= 0) {close(m_fd);}
+}
+
+
+int
+DirectIO::Open(const char *pfn, int wrapped_fd, int access)
+{
+    int fd = open(pfn, (access & O_ACCMODE) | O_DIRECT | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) {return -errno;}
+    // The path may have been replaced since the wrapped open.
+    struct stat direct_st, wrapped_st;
+    if (fstat(fd, &direct_st) || fstat(wrapped_fd, &wrapped_st) ||
+        (direct_st.st_dev != wrapped_st.st_dev) || (direct_st.st_ino != wrapped_st.st_ino))
+    {
+        close(fd);
+        return -ESTALE;
+    }
+
+    size_t mem_align = 0, offset_align = 0;
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+    if (!statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) && (stx.stx_mask & STATX_DIOALIGN)) {
+        // Zero alignments: no direct I/O for this file.
+        if (!stx.stx_dio_offset_align) {
+            close(fd);
+            return -EINVAL;
+        }
+        mem_align = stx.stx_dio_mem_align;
+        offset_align = stx.stx_dio_offset_align;
+    }
+#endif
+    if (!offset_align) {
+        // Older kernels: guess from the preferred I/O size; if that is too
+        // small, the first transfer fails with EINVAL and the file falls
+        // back to buffered I/O.
+        size_t blksize = direct_st.st_blksize;
+        offset_align = ((blksize >= 512) && (blksize <= 65536) && !(blksize & (blksize - 1))) ? blksize : 4096;
+        mem_align = offset_align;
+    }
+    if (!mem_align || (mem_align > m_pool_align) || (mem_align & (mem_align - 1)) ||
+        (offset_align > m_bounce_size) || (offset_align & (offset_align - 1)))
+    {
+        close(fd);
+        return -EINVAL;
+    }
+    m_mem_align = mem_align;
+    m_offset_align = offset_align;
+    m_fd = fd;
+    m_usable = true;
+    return 0;
+}
+
+
+void
+DirectIO::Disable()
+{
+    // Other requests may still be using the descriptor; it is closed with
+    // the file.
+    m_usable = false;
+}
+
+
+ssize_t
+DirectIO::Read(XrdOssDF &buffered, void *buffer, off_t offset, size_t size)
+{
+    if (!m_usable) {return buffered.Read(buffer, offset, size);}
+    auto out = static_cast<char *>(buffer);
+
+    ssize_t result;
+    if (!(reinterpret_cast<uintptr_t>(out) % m_mem_align) && !(offset % m_offset_align) && !(size % m_offset_align)) {
+        result = ReadAligned(out, offset, size);
+    } else {
+        // Read the blocks covering each piece into a bounce buffer and copy
+        // out the requested part.
+        Bounce bounce;
+        if (!bounce.Get()) {return buffered.Read(buffer, offset, size);}
+        size_t done = 0;
+        result = 0;
+        while (done < size) {
+            off_t pos = offset + done;
+            off_t start = pos - (pos % m_offset_align);
+            size_t lead = pos - start;
+            size_t want = std::min(size - done, m_bounce_size - lead);
+            size_t len = (lead + want + m_offset_align - 1) / m_offset_align * m_offset_align;
+            result = ReadAligned(bounce.Get(), start, len);
+            if (result < 0) {break;}
+            if (static_cast<size_t>(result) <= lead) {break;}
+            size_t got = std::min(want, static_cast<size_t>(result) - lead);
+            memcpy(out + done, bounce.Get() + lead, got);
+            done += got;
+            // Short of what was asked: the end of the file.
+            if (got < want) {break;}
+        }
+        if ((result >= 0) || done) {result = done;}
+    }
+    if ((result == -EINVAL) && !m_usable) {return buffered.Read(buffer, offset, size);}
+    return result;
+}
+
+
+ssize_t
+DirectIO::Write(XrdOssDF &buffered, const void *buffer, off_t offset, size_t size)
+{
+    if (!m_usable) {return buffered.Write(buffer, offset, size);}
+    auto data = static_cast<const char *>(buffer);
+    off_t end = offset + size;
+    off_t aligned_start = (offset + m_offset_align - 1) / m_offset_align * m_offset_align;
+    off_t aligned_end = end - (end % m_offset_align);
+    if (aligned_end <= aligned_start) {return buffered.Write(buffer, offset, size);}
+
+    size_t head = aligned_start - offset;
+    if (head) {
+        auto result = buffered.Write(data, offset, head);
+        if (result < static_cast<ssize_t>(head)) {return result;}
+    }
+
+    size_t middle = aligned_end - aligned_start;
+    auto result = WriteAligned(data + head, aligned_start, middle);
+    if ((result == -EINVAL) && !m_usable) {
+        result = buffered.Write(data + head, aligned_start, size - head);
+        return (result < 0) ? (head ? static_cast<ssize_t>(head) : result) : static_cast<ssize_t>(head + result);
+    }
+    if (result < static_cast<ssize_t>(middle)) {
+        return (result < 0) ? (head ? static_cast<ssize_t>(head) : result) : static_cast<ssize_t>(head + result);
+    }
+
+    size_t tail = end - aligned_end;
+    if (tail) {
+        result = buffered.Write(data + head + middle, aligned_end, tail);
+        if (result < 0) {return head + middle;}
+        return head + middle + result;
+    }
+    return size;
+}
+
+
+ssize_t
+DirectIO::ReadAligned(char *buffer, off_t offset, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        size_t want = size - done;
+        auto result = pread(m_fd, buffer + done, want, offset + done);
+        if (result < 0) {
+            if (errno == EINTR) {continue;}
+            int err = errno;
+            // Only the first transfer tells whether O_DIRECT works here.
+            if ((err == EINVAL) && !done) {Disable();}
+            return done ? static_cast<ssize_t>(done) : -err;
+        }
+        done += result;
+        // A direct read only comes up short at the end of the file.
+        if (static_cast<size_t>(result) < want) {break;}
+    }
+    return done;
+}
+
+
+ssize_t
+DirectIO::WriteAligned(const char *buffer, off_t offset, size_t size)
+{
+    bool aligned = !(reinterpret_cast<uintptr_t>(buffer) % m_mem_align);
+    std::unique_ptr<Bounce> bounce;
+    if (!aligned) {
+        bounce.reset(new Bounce());
+        if (!bounce->Get()) {return -ENOMEM;}
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        size_t len = size - done;
+        const char *source = buffer + done;
+        if (!aligned) {
+            len = std::min(len, m_bounce_size);
+            memcpy(bounce->Get(), source, len);
+            source = bounce->Get();
+        }
+        auto result = pwrite(m_fd, source, len, offset + done);
+        if (result < 0) {
+            if (errno == EINTR) {continue;}
+            int err = errno;
+            if ((err == EINVAL) && !done) {Disable();}
+            return done ? static_cast<ssize_t>(done) : -err;
+        }
+        if (!result) {break;}
+        done += result;
+    }
+    return done;
+}
@@ -0,0 +1,106 @@
+#ifndef __MULTIUSERDIRECTIO_HH__
+#define __MULTIUSERDIRECTIO_HH__
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+class XrdOssDF;
+
+
+/**
+ * O_DIRECT streaming for large transfers (multiuser.directio).
+ *
+ * An eligible file gets a second descriptor, opened with O_DIRECT on the
+ * same inode, which Read and Write use so multi-GB transfers bypass the
+ * page cache.  Direct I/O needs aligned offsets, lengths and memory; the
+ * alignments are queried per file (statx STATX_DIOALIGN, falling back to
+ * st_blksize):
+ *
+ *  - Reads are widened to whole blocks and, unless the client's buffer and
+ *    range already are aligned, go through bounce buffers from a shared pool
+ *    and are copied out.  A short read at the end of the file is trimmed.
+ *  - Writes send their block-aligned middle directly (through a bounce
+ *    buffer if the client's memory is unaligned); the partial blocks at
+ *    either end, including the final partial block of the file, go through
+ *    the wrapped, buffered file.  The kernel keeps the two coherent.
+ *
+ * A file system rejecting O_DIRECT (EINVAL) turns the file back to buffered
+ * I/O.  The second descriptor goes around the wrapped OSS, so direct I/O
+ * is only enabled when the wrapped OSS is the default one.
+ */
+class DirectIO {
+public:
+    // Files of at least `min_size` bytes (zero: any size) below one of the
+    // `prefixes` (logical paths; empty: anywhere) are eligible.
+    static void Configure(bool enabled, size_t min_size, const std::vector<std::string> &prefixes)
+    {
+        m_enabled = enabled;
+        m_min_size = min_size;
+        m_prefixes = prefixes;
+    }
+    static bool IsEnabled() {return m_enabled;}
+    static size_t GetMinimumSize() {return m_min_size;}
+    static const std::vector<std::string> &GetPrefixes() {return m_prefixes;}
+
+    // Whether a file at the logical `path` which is or will be `size` bytes
+    // long (negative if unknown) should use direct I/O.
+    static bool IsEligible(const char *path, long long size);
+
+    // Open the physical path `pfn` for direct I/O with the access mode
+    // (O_RDONLY, O_WRONLY or O_RDWR) of `wrapped_fd`, checking that it is
+    // the same file and that its alignment requirements can be met.
+    // Returns a negative errno on failure.
+    int Open(const char *pfn, int wrapped_fd, int access);
+    bool IsOpen() const {return m_usable;}
+
+    DirectIO() {}
+    ~DirectIO();
+
+    // Like pread/pwrite.  Write passes the unaligned ends of the range to
+    // `buffered`, which also takes over if direct I/O turns out not to be
+    // supported.  Return the bytes transferred or a negative errno.
+    ssize_t Read(XrdOssDF &buffered, void *buffer, off_t offset, size_t size);
+    ssize_t Write(XrdOssDF &buffered, const void *buffer, off_t offset, size_t size);
+
+private:
+    DirectIO(const DirectIO &) = delete;
+    DirectIO &operator=(const DirectIO &) = delete;
+
+    // Alignment of the pooled bounce buffers.
+    static const size_t m_pool_align = 4096;
+    static const size_t m_bounce_size = 1024 * 1024;
+    static const size_t m_max_idle_buffers = 64;
+
+    // A bounce buffer from the pool, returned when it goes out of scope.
+    class Bounce {
+    public:
+        Bounce();
+        ~Bounce();
+        char *Get() const {return m_data;}
+    private:
+        char *m_data;
+    };
+
+    ssize_t ReadAligned(char *buffer, off_t offset, size_t size);
+    ssize_t WriteAligned(const char *buffer, off_t offset, size_t size);
+    void Disable();
+
+    int m_fd{-1};
+    std::atomic<bool> m_usable{false};
+    size_t m_mem_align{m_pool_align};
+    size_t m_offset_align{m_pool_align};
+
+    static bool m_enabled;
+    static size_t m_min_size;
+    static std::vector<std::string> m_prefixes;
+
+    static std::mutex m_pool_mutex;
+    static std::vector<char *> m_pool;
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef __MULTIUSERDIRECTORYREADER_HH__
+#define __MULTIUSERDIRECTORYREADER_HH__
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+
+/**
+ * Batched directory listing with entry attributes (multiuser.readdirplus).
+ *
+ * Used by MultiuserDirectory once the caller asks for per-entry attributes
+ * (StatRet).  Entries are read with large getdents64 calls and the stat of a
+ * whole buffer of entries is fetched at once (through the thread's io_uring
+ * when available), instead of one readdir plus one stat round trip per entry.
+ * All calls must be made under the user's credentials.  It reads the
+ * physical directory itself, so it is only enabled when the wrapped OSS is
+ * the default one.
+ */
+class DirectoryReader {
+public:
+    static void Configure(bool enabled, bool dont_sync)
+    {
+        m_enabled = enabled;
+        m_dont_sync = dont_sync;
+    }
+    static bool IsEnabled() {return m_enabled;}
+    static bool IsDontSync() {return m_dont_sync;}
+
+    DirectoryReader() {}
+    ~DirectoryReader();
+
+    // Open the (physical) directory path.  Returns 0 or a negative errno.
+    int Open(const char *path);
+
+    // Copy the next entry's name to buff and its attributes to *stat, like
+    // XrdOssDir::Readdir with StatRet set; at the end of the directory buff
+    // is set to the empty string.  An entry which cannot be stat'd is
+    // returned with zeroed attributes.  Returns 0 or a negative errno.
+    int Next(char *buff, int blen, struct stat *stat);
+
+private:
+    DirectoryReader(const DirectoryReader &) = delete;
+    DirectoryReader &operator=(const DirectoryReader &) = delete;
+
+    // Read the next buffer of entries and stat them.
+    int Fill();
+
+    struct Entry {
+        const char *m_name;
+        int m_rc;
+        struct stat m_stat;
+    };
+
+    int m_fd{-1};
+    bool m_eof{false};
+    std::unique_ptr<char[]> m_dents;
+    std::vector<Entry> m_entries;
+    size_t m_next{0};
+
+    static bool m_enabled;
+    static bool m_dont_sync;
+};
+
+#endif
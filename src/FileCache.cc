@@ -0,0 +1,208 @@
+#include "FileCache.hh"
+
+#include "XrdSfs/XrdSfsAio.hh"
+
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+FileCache &
+FileCache::Instance()
+{
+    static FileCache cache;
+    return cache;
+}
+
+
+FileCache::Entry::~Entry()
+{
+    if (m_fd >= 0) {close(m_fd);}
+}
+
+
+long long
+FileCache::Now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now().time_since_epoch()).count();
+}
+
+
+bool
+FileCache::SameFile(const struct stat &a, const struct stat &b)
+{
+    return (a.st_dev == b.st_dev) && (a.st_ino == b.st_ino) && (a.st_size == b.st_size) &&
+           (a.st_mtim.tv_sec == b.st_mtim.tv_sec) && (a.st_mtim.tv_nsec == b.st_mtim.tv_nsec) &&
+           (a.st_ctim.tv_sec == b.st_ctim.tv_sec) && (a.st_ctim.tv_nsec == b.st_ctim.tv_nsec);
+}
+
+
+std::shared_ptr<FileCache::Entry>
+FileCache::Get(const UserIdentity &identity, const std::string &path)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto iter = m_entries.find(path);
+    if (iter != m_entries.end()) {
+        for (const auto &entry : iter->second) {
+            if ((entry->m_uid != identity.m_uid) || (entry->m_gid != identity.m_gid) ||
+                (entry->m_groups != identity.m_groups))
+            {
+                continue;
+            }
+            m_lru.splice(m_lru.begin(), m_lru, entry->m_lru);
+            m_hits++;
+            return entry;
+        }
+    }
+    m_misses++;
+    return nullptr;
+}
+
+
+bool
+FileCache::IsStale(const Entry &entry) const
+{
+    return Now() - entry.m_validated.load() >= std::chrono::duration_cast<std::chrono::nanoseconds>(m_revalidate).count();
+}
+
+
+bool
+FileCache::Revalidate(const std::shared_ptr<Entry> &entry, const char *pfn)
+{
+    m_revalidations++;
+    struct stat st;
+    if (!stat(pfn, &st) && SameFile(st, entry->m_stat)) {
+        entry->m_validated = Now();
+        return true;
+    }
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (entry->m_cached) {
+        m_invalidations++;
+        Remove(entry);
+    }
+    return false;
+}
+
+
+void
+FileCache::Put(const UserIdentity &identity, const std::string &path, int fd)
+{
+    struct stat st;
+    if ((fd < 0) || fstat(fd, &st) || !S_ISREG(st.st_mode) || (static_cast<size_t>(st.st_size) > m_max_size)) {
+        return;
+    }
+    std::shared_ptr<Entry> entry(new Entry());
+    entry->m_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (entry->m_fd < 0) {return;}
+    entry->m_stat = st;
+    entry->m_path = path;
+    entry->m_uid = identity.m_uid;
+    entry->m_gid = identity.m_gid;
+    entry->m_groups = identity.m_groups;
+    entry->m_validated = Now();
+
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto &entries = m_entries[path];
+    for (const auto &existing : entries) {
+        // Another open of the same file got here first.
+        if ((existing->m_uid == entry->m_uid) && (existing->m_gid == entry->m_gid) &&
+            (existing->m_groups == entry->m_groups))
+        {
+            return;
+        }
+    }
+    while (!m_lru.empty() && (m_lru.size() >= m_max_fds)) {
+        m_evictions++;
+        Remove(m_lru.back());
+    }
+    m_lru.push_front(entry);
+    entry->m_lru = m_lru.begin();
+    // Eviction may have erased this path's (empty) list.
+    m_entries[path].push_back(entry);
+}
+
+
+void
+FileCache::Invalidate(const std::string &path)
+{
+    if (!IsEnabled()) {return;}
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto iter = m_entries.find(path);
+    if (iter == m_entries.end()) {return;}
+    auto entries = iter->second;
+    for (const auto &entry : entries) {
+        m_invalidations++;
+        Remove(entry);
+    }
+}
+
+
+void
+FileCache::Remove(const std::shared_ptr<Entry> &entry)
+{
+    // Keep the entry alive until we are done with it; the caller's reference
+    // may be the one in m_lru.
+    auto keep = entry;
+    keep->m_cached = false;
+    auto iter = m_entries.find(keep->m_path);
+    if (iter != m_entries.end()) {
+        auto &entries = iter->second;
+        for (auto pos = entries.begin(); pos != entries.end(); ++pos) {
+            if (*pos == keep) {
+                entries.erase(pos);
+                break;
+            }
+        }
+        if (entries.empty()) {m_entries.erase(iter);}
+    }
+    m_lru.erase(keep->m_lru);
+}
+
+
+void
+FileCache::Stats(std::ostream &os) const
+{
+    os << "<filecache><hits>" << m_hits.load()
+       << "</hits><misses>" << m_misses.load()
+       << "</misses><revalidations>" << m_revalidations.load()
+       << "</revalidations><invalidations>" << m_invalidations.load()
+       << "</invalidations><evictions>" << m_evictions.load()
+       << "</evictions></filecache>";
+}
+
+
+int
+CachedFile::Close(long long *retsz)
+{
+    if (retsz) {*retsz = 0;}
+    m_entry.reset();
+    fd = -1;
+    return 0;
+}
+
+
+int
+CachedFile::Fstat(struct stat *buf)
+{
+    if (!m_entry) {return -EBADF;}
+    return fstat(m_entry->m_fd, buf) ? -errno : 0;
+}
+
+
+ssize_t
+CachedFile::Read(void *buffer, off_t offset, size_t size)
+{
+    if (!m_entry) {return -EBADF;}
+    auto result = pread(m_entry->m_fd, buffer, size, offset);
+    return (result < 0) ? -errno : result;
+}
+
+
+int
+CachedFile::Read(XrdSfsAio *aiop)
+{
+    aiop->Result = Read(const_cast<void *>(aiop->sfsAio.aio_buf), aiop->sfsAio.aio_offset, aiop->sfsAio.aio_nbytes);
+    aiop->doneRead();
+    return 0;
+}
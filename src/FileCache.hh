@@ -0,0 +1,147 @@
+#ifndef __MULTIUSERFILECACHE_HH__
+#define __MULTIUSERFILECACHE_HH__
+
+#include "IdentityCache.hh"
+
+#include "XrdOss/XrdOss.hh"
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+
+/**
+ * A bounded cache of read-only descriptors of small files, shared by all
+ * MultiuserFile instances (multiuser.filecache).
+ *
+ * Entries are keyed by the logical path and the full identity (UID, GID and
+ * groups) the file was opened with, so a descriptor is only handed to a
+ * user who was already allowed to open that file.  An entry is checked
+ * against the path, by a stat() as the user, once it is older than the
+ * revalidation interval: the device, inode, size, mtime and ctime (which
+ * covers permission changes) must still match, and the stat itself re-checks
+ * the user's access to the directories.  Changes made through this server
+ * (writes, truncation, chmod, rename, unlink) drop the path's entries right
+ * away.  Within the revalidation interval, neither the file nor the user's
+ * access to it is checked again.  Entries are evicted least-recently-used
+ * beyond the descriptor budget; an evicted descriptor is closed once its
+ * last user is done.
+ *
+ * A hit skips the wrapped OSS's Open entirely, so the cache is only enabled
+ * when the wrapped OSS is the default one (see MultiuserFileSystem::Config).
+ */
+class FileCache {
+public:
+    struct Entry {
+        ~Entry();
+
+        int m_fd{-1};
+        struct stat m_stat;
+        std::string m_path;
+        uid_t m_uid{0};
+        gid_t m_gid{0};
+        std::vector<gid_t> m_groups;
+        // Nanoseconds since the steady clock's epoch.
+        std::atomic<long long> m_validated{0};
+        bool m_cached{true};
+        std::list<std::shared_ptr<Entry>>::iterator m_lru;
+    };
+
+    static FileCache &Instance();
+
+    // A budget of zero disables the cache.
+    void Configure(size_t max_fds, size_t max_size, unsigned revalidate)
+    {
+        m_max_fds = max_fds;
+        m_max_size = max_size;
+        m_revalidate = std::chrono::seconds(revalidate);
+    }
+    void Disable() {m_max_fds = 0;}
+    bool IsEnabled() const {return m_max_fds;}
+    size_t GetMaxFds() const {return m_max_fds;}
+    size_t GetMaxSize() const {return m_max_size;}
+    unsigned GetRevalidate() const {return m_revalidate.count();}
+
+    // The cached entry for `path` opened by `identity`, or null.
+    std::shared_ptr<Entry> Get(const UserIdentity &identity, const std::string &path);
+
+    // Whether an entry must be checked with Revalidate before use.
+    bool IsStale(const Entry &entry) const;
+
+    // Compare an entry with what the physical path `pfn` now refers to,
+    // dropping it on mismatch.  Must run with the user's credentials.
+    bool Revalidate(const std::shared_ptr<Entry> &entry, const char *pfn);
+
+    // Cache a duplicate of `fd`, which `identity` opened read-only at `path`,
+    // if the file is small enough.
+    void Put(const UserIdentity &identity, const std::string &path, int fd);
+
+    // Drop all entries for a path which was modified.
+    void Invalidate(const std::string &path);
+
+    // Append the cache's counters to a statistics report.
+    void Stats(std::ostream &os) const;
+
+private:
+    FileCache() {}
+    FileCache(const FileCache &) = delete;
+    FileCache &operator=(const FileCache &) = delete;
+
+    typedef std::chrono::steady_clock clock;
+
+    static long long Now();
+    static bool SameFile(const struct stat &a, const struct stat &b);
+
+    // Remove an entry; must be called with m_mutex held.
+    void Remove(const std::shared_ptr<Entry> &entry);
+
+    size_t m_max_fds{0};
+    size_t m_max_size{1024 * 1024};
+    std::chrono::seconds m_revalidate{1};
+
+    std::mutex m_mutex;
+    std::unordered_map<std::string, std::vector<std::shared_ptr<Entry>>> m_entries;
+    // Most-recently-used entries are at the front.
+    std::list<std::shared_ptr<Entry>> m_lru;
+
+    std::atomic<unsigned long long> m_hits{0};
+    std::atomic<unsigned long long> m_misses{0};
+    std::atomic<unsigned long long> m_revalidations{0};
+    std::atomic<unsigned long long> m_invalidations{0};
+    std::atomic<unsigned long long> m_evictions{0};
+};
+
+
+/**
+ * A file served from a FileCache entry, standing in for the wrapped OSS
+ * file in MultiuserFile.  Only supports reading; vector and page reads use
+ * the XrdOssDF implementations on top of Read.
+ */
+class CachedFile : public XrdOssDF {
+public:
+    CachedFile(const char *tident, const std::shared_ptr<FileCache::Entry> &entry) :
+        XrdOssDF(tident, 0, entry->m_fd),
+        m_entry(entry)
+    {}
+
+    int     Close(long long *retsz=0) override;
+    int     Fstat(struct stat *buf) override;
+    ssize_t Read(off_t offset, size_t size) override {return 0;}
+    ssize_t Read(void *buffer, off_t offset, size_t size) override;
+    int     Read(XrdSfsAio *aiop) override;
+    ssize_t ReadRaw(void *buffer, off_t offset, size_t size) override {return Read(buffer, offset, size);}
+
+private:
+    std::shared_ptr<FileCache::Entry> m_entry;
+};
+
+#endif
@@ -0,0 +1,106 @@
+#include "GroupCommit.hh"
+
+#include "XrdOss/XrdOss.hh"
+
+#include <cerrno>
+#include <map>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const size_t GroupCommit::m_max_batch;
+GroupCommit *GroupCommit::m_instance = nullptr;
+
+
+void
+GroupCommit::Configure(unsigned window_us, Mode mode)
+{
+    if (m_instance) {return;}
+    m_instance = new GroupCommit(window_us, mode);
+    std::thread durability(&GroupCommit::Run, m_instance);
+    durability.detach();
+}
+
+
+int
+GroupCommit::Sync(XrdOssDF &file)
+{
+    auto self = m_instance;
+    if (!self) {return file.Fsync();}
+    self->m_requests++;
+
+    Request request;
+    request.m_fd = file.getFD();
+    {
+        std::unique_lock<std::mutex> lock(self->m_mutex);
+        self->m_queue.push_back(&request);
+        self->m_queued_cv.notify_one();
+        self->m_done_cv.wait(lock, [&] {return request.m_ready;});
+    }
+    int result = file.Fsync();
+    return result ? result : request.m_syncfs_result;
+}
+
+
+void
+GroupCommit::Run()
+{
+    std::vector<Request *> batch;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_queued_cv.wait(lock, [&] {return !m_queue.empty();});
+            // Give other writers a chance to join this batch.
+            m_queued_cv.wait_for(lock, m_window, [&] {return m_queue.size() >= m_max_batch;});
+            batch.swap(m_queue);
+        }
+        m_batches++;
+        Process(batch);
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            for (auto request : batch) {request->m_ready = true;}
+        }
+        m_done_cv.notify_all();
+        batch.clear();
+    }
+}
+
+
+void
+GroupCommit::Process(std::vector<Request *> &batch)
+{
+    if (m_mode == Fsync) {
+        for (auto request : batch) {
+            if (request->m_fd >= 0) {sync_file_range(request->m_fd, 0, 0, SYNC_FILE_RANGE_WRITE);}
+        }
+        return;
+    }
+
+    // Errors from syncfs are not tied to a file; fail every file on that
+    // file system rather than risk acknowledging lost data.
+    std::map<dev_t, int> syncfs_results;
+    for (auto request : batch) {
+        struct stat st;
+        if ((request->m_fd < 0) || fstat(request->m_fd, &st)) {continue;}
+        auto iter = syncfs_results.find(st.st_dev);
+        if (iter == syncfs_results.end()) {
+            m_syncfs_calls++;
+            iter = syncfs_results.emplace(st.st_dev, syncfs(request->m_fd) ? -errno : 0).first;
+        }
+        request->m_syncfs_result = iter->second;
+    }
+}
+
+
+void
+GroupCommit::Stats(std::ostream &os)
+{
+    auto self = m_instance;
+    if (!self) {return;}
+    os << "<groupcommit><requests>" << self->m_requests.load()
+       << "</requests><batches>" << self->m_batches.load()
+       << "</batches><syncfs>" << self->m_syncfs_calls.load()
+       << "</syncfs></groupcommit>";
+}
@@ -0,0 +1,87 @@
+#ifndef __MULTIUSERGROUPCOMMIT_HH__
+#define __MULTIUSERGROUPCOMMIT_HH__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+class XrdOssDF;
+
+/**
+ * Group commit of Fsync requests (multiuser.groupcommit).
+ *
+ * Callers hand their file to a dedicated durability thread and wait.
+ * The thread collects the requests arriving within a short window and does
+ * the work they can share as one batch:
+ *
+ *  - fsync mode starts writeback of every file in the batch at once, so
+ *    their data is already in flight when they are synced.
+ *  - syncfs mode issues one syncfs per file system in the batch, after
+ *    which syncing each file is cheap.
+ *
+ * The batch's callers are then released together and each syncs its own
+ * file on its own thread, in parallel, with XrdOssDF::Fsync; a stacked OSS
+ * therefore still syncs whatever else it keeps for the file (e.g., XrdOssCsi
+ * tag files), and no caller waits for another file's sync.  A caller
+ * returns that sync's result (or the syncfs error of its file system), so
+ * the guarantee is that of a plain Fsync.
+ */
+class GroupCommit {
+public:
+    enum Mode {
+        Fsync,
+        Syncfs
+    };
+
+    // Start the durability thread.
+    static void Configure(unsigned window_us, Mode mode);
+    static bool IsEnabled() {return m_instance;}
+    static unsigned GetWindow() {return m_instance ? m_instance->m_window.count() : 0;}
+    static Mode GetMode() {return m_instance ? m_instance->m_mode : Fsync;}
+
+    // Fsync `file` as part of the next batch.  Returns 0 or a negative errno.
+    static int Sync(XrdOssDF &file);
+
+    // Append the counters to a statistics report.
+    static void Stats(std::ostream &os);
+
+private:
+    GroupCommit(unsigned window_us, Mode mode) :
+        m_window(window_us),
+        m_mode(mode)
+    {}
+
+    struct Request {
+        // The underlying descriptor, used for writeback hints and syncfs;
+        // -1 if the file has none.
+        int m_fd;
+        // The result of the syncfs covering the file, if any.
+        int m_syncfs_result{0};
+        bool m_ready{false};
+    };
+
+    void Run();
+    void Process(std::vector<Request *> &batch);
+
+    // Stop waiting for more requests once a batch is this large.
+    static const size_t m_max_batch = 256;
+
+    const std::chrono::microseconds m_window;
+    const Mode m_mode;
+
+    std::mutex m_mutex;
+    std::condition_variable m_queued_cv;
+    std::condition_variable m_done_cv;
+    std::vector<Request *> m_queue;
+
+    std::atomic<unsigned long long> m_requests{0};
+    std::atomic<unsigned long long> m_batches{0};
+    std::atomic<unsigned long long> m_syncfs_calls{0};
+
+    static GroupCommit *m_instance;
+};
+
+#endif
@@ -0,0 +1,182 @@
+#include "IdMap.hh"
+
+#include "XrdSys/XrdSysError.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(sizeof(gid_t) == sizeof(uint32_t), "idmap groups are stored as 32-bit GIDs");
+
+// How often (in seconds) the map file is checked for replacement.
+static const long long g_idmap_check_interval = 5;
+
+
+static long long
+MonotonicSeconds()
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+IdMap &
+IdMap::Instance()
+{
+    static IdMap idmap;
+    return idmap;
+}
+
+
+IdMap::MappedFile::~MappedFile()
+{
+    if (m_addr) {munmap(m_addr, m_size);}
+}
+
+
+std::shared_ptr<const IdMap::MappedFile>
+IdMap::Open(const std::string &path, XrdSysError &log)
+{
+    std::shared_ptr<MappedFile> map;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log.Emsg("IdMap", errno, "open identity map", path.c_str());
+        return map;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        log.Emsg("IdMap", errno, "stat identity map", path.c_str());
+        close(fd);
+        return map;
+    }
+    if (static_cast<size_t>(st.st_size) < sizeof(IdMapHeader)) {
+        log.Emsg("IdMap", "Identity map is truncated:", path.c_str());
+        close(fd);
+        return map;
+    }
+    void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        log.Emsg("IdMap", errno, "mmap identity map", path.c_str());
+        return map;
+    }
+    map.reset(new MappedFile());
+    map->m_addr = addr;
+    map->m_size = st.st_size;
+    map->m_dev = st.st_dev;
+    map->m_ino = st.st_ino;
+    map->m_mtime = st.st_mtime;
+
+    // Validate every section lies within the file before trusting it.
+    auto base = static_cast<const char *>(addr);
+    auto header = reinterpret_cast<const IdMapHeader *>(base);
+    uint64_t size = map->m_size;
+    bool valid = !memcmp(header->m_magic, IDMAP_MAGIC, sizeof(header->m_magic)) &&
+        (header->m_version == IDMAP_VERSION) &&
+        (header->m_records_off <= size) &&
+        (header->m_count <= (size - header->m_records_off) / sizeof(IdMapRecord)) &&
+        (header->m_groups_off <= size) && (header->m_groups_off % sizeof(uint32_t) == 0) &&
+        (header->m_groups_count <= (size - header->m_groups_off) / sizeof(uint32_t)) &&
+        (header->m_strings_off <= size) &&
+        (header->m_strings_len <= size - header->m_strings_off) &&
+        (header->m_records_off % alignof(IdMapRecord) == 0);
+    if (valid) {
+        auto records = reinterpret_cast<const IdMapRecord *>(base + header->m_records_off);
+        for (uint32_t idx = 0; valid && (idx < header->m_count); idx++) {
+            const auto &record = records[idx];
+            valid = (record.m_name_off <= header->m_strings_len) &&
+                (record.m_name_len <= header->m_strings_len - record.m_name_off) &&
+                (record.m_groups_idx <= header->m_groups_count) &&
+                (record.m_ngroups <= header->m_groups_count - record.m_groups_idx) &&
+                (!idx || (records[idx - 1].m_hash <= record.m_hash));
+        }
+    }
+    if (!valid) {
+        log.Emsg("IdMap", "Identity map is corrupt or has an unsupported version:", path.c_str());
+        map.reset();
+        return map;
+    }
+    map->m_header = header;
+    map->m_records = reinterpret_cast<const IdMapRecord *>(base + header->m_records_off);
+    map->m_groups = reinterpret_cast<const uint32_t *>(base + header->m_groups_off);
+    map->m_strings = base + header->m_strings_off;
+    return map;
+}
+
+
+bool
+IdMap::Configure(const std::string &path, bool exclusive, XrdSysError &log)
+{
+    auto map = Open(path, log);
+    if (!map) {return false;}
+    std::atomic_store(&m_map, map);
+    m_path = path;
+    m_exclusive = exclusive;
+    m_log = &log;
+    m_next_check = MonotonicSeconds() + g_idmap_check_interval;
+
+    std::stringstream ss;
+    ss << "Loaded " << map->m_header->m_count << " identities from " << path;
+    log.Emsg("Config", ss.str().c_str());
+    return true;
+}
+
+
+void
+IdMap::MaybeReload()
+{
+    auto now = MonotonicSeconds();
+    auto next_check = m_next_check.load(std::memory_order_relaxed);
+    if (now < next_check) {return;}
+    // Only one thread performs the check.
+    if (!m_next_check.compare_exchange_strong(next_check, now + g_idmap_check_interval)) {return;}
+
+    struct stat st;
+    if (stat(m_path.c_str(), &st) < 0) {return;}
+    auto current = std::atomic_load(&m_map);
+    if (current && (current->m_dev == st.st_dev) && (current->m_ino == st.st_ino) &&
+        (current->m_mtime == st.st_mtime) && (current->m_size == static_cast<size_t>(st.st_size)))
+    {
+        return;
+    }
+    // On failure, keep serving the previous map.
+    auto map = Open(m_path, *m_log);
+    if (!map) {return;}
+    std::atomic_store(&m_map, map);
+    m_generation++;
+    m_log->Emsg("IdMap", "Reloaded identity map", m_path.c_str());
+}
+
+
+bool
+IdMap::Lookup(const std::string &username, Entry &entry)
+{
+    MaybeReload();
+    auto map = std::atomic_load(&m_map);
+    if (!map) {return false;}
+
+    auto hash = IdMapHash(username.c_str(), username.size());
+    auto begin = map->m_records;
+    auto end = begin + map->m_header->m_count;
+    auto iter = std::lower_bound(begin, end, hash,
+        [](const IdMapRecord &record, uint64_t value) {return record.m_hash < value;});
+    for (; (iter != end) && (iter->m_hash == hash); ++iter) {
+        if ((iter->m_name_len != username.size()) ||
+            memcmp(map->m_strings + iter->m_name_off, username.c_str(), username.size()))
+        {
+            continue;
+        }
+        entry.m_uid = iter->m_uid;
+        entry.m_gid = iter->m_gid;
+        entry.m_groups = reinterpret_cast<const gid_t *>(map->m_groups + iter->m_groups_idx);
+        entry.m_ngroups = iter->m_ngroups;
+        entry.m_handle = map;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,95 @@
+#ifndef __MULTIUSERIDMAP_HH__
+#define __MULTIUSERIDMAP_HH__
+
+#include "IdMapFormat.hh"
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include <sys/types.h>
+
+class XrdSysError;
+
+
+/**
+ * A read-only, memory-mapped username -> identity map (multiuser.idmap).
+ *
+ * Lookups search the mapped file in place, without NSS or a global map lock.
+ * Taking a reference to the current map uses std::atomic_load on a
+ * shared_ptr, which libstdc++ implements with a small pool of mutexes, and
+ * the caller copies the result into its own UserIdentity.  The map is
+ * swapped when the file on disk is replaced (the generator tool writes a
+ * temporary file and renames it into place), and each swap bumps the
+ * generation so IdentityCache can drop results taken from the old map.
+ */
+class IdMap {
+private:
+    struct MappedFile;
+
+public:
+    struct Entry {
+        uid_t m_uid{0};
+        gid_t m_gid{0};
+        // Points into the mapped file; only valid while m_handle is held.
+        const gid_t *m_groups{nullptr};
+        size_t m_ngroups{0};
+        std::shared_ptr<const MappedFile> m_handle;
+    };
+
+    static IdMap &Instance();
+
+    // Map the file at `path`; if `exclusive`, usernames missing from the
+    // map are not looked up via NSS.  Called once at configuration time.
+    bool Configure(const std::string &path, bool exclusive, XrdSysError &log);
+
+    bool IsConfigured() const {return !m_path.empty();}
+    bool IsExclusive() const {return m_exclusive;}
+
+    // Returns true and fills in `entry` if the username is in the map.
+    bool Lookup(const std::string &username, Entry &entry);
+
+    // Incremented whenever a new map is swapped in; picks up a replaced
+    // file first, so it may stat() it.  Always 0 if no map is configured.
+    unsigned Generation()
+    {
+        if (!IsConfigured()) {return 0;}
+        MaybeReload();
+        return m_generation.load();
+    }
+
+private:
+    IdMap() {}
+    IdMap(const IdMap &) = delete;
+    IdMap &operator=(const IdMap &) = delete;
+
+    struct MappedFile {
+        ~MappedFile();
+
+        void *m_addr{nullptr};
+        size_t m_size{0};
+        dev_t m_dev{0};
+        ino_t m_ino{0};
+        time_t m_mtime{0};
+        const IdMapHeader *m_header{nullptr};
+        const IdMapRecord *m_records{nullptr};
+        const uint32_t *m_groups{nullptr};
+        const char *m_strings{nullptr};
+    };
+
+    static std::shared_ptr<const MappedFile> Open(const std::string &path, XrdSysError &log);
+
+    // Reload the map if the file has changed; rate-limited to one stat()
+    // every few seconds across all threads.
+    void MaybeReload();
+
+    // Accessed only through std::atomic_load / std::atomic_store.
+    std::shared_ptr<const MappedFile> m_map;
+    std::atomic<long long> m_next_check{0};
+    std::atomic<unsigned> m_generation{0};
+    std::string m_path;
+    bool m_exclusive{false};
+    XrdSysError *m_log{nullptr};
+};
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef __MULTIUSERIDMAPFORMAT_HH__
+#define __MULTIUSERIDMAPFORMAT_HH__
+
+/**
+ * On-disk layout of the binary identity map used by multiuser.idmap and
+ * written by the xrootd-multiuser-idmap tool.
+ *
+ * The file is a header followed by three sections:
+ *   - records: one IdMapRecord per user, sorted by (m_hash, name);
+ *   - groups:  a flat array of uint32_t supplementary GIDs, indexed by
+ *              IdMapRecord::m_groups_idx;
+ *   - strings: the concatenated usernames (not NUL-terminated).
+ *
+ * Integers are stored in host byte order; the map is meant to be generated
+ * on (or for) the hosts that read it.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#define IDMAP_MAGIC "XMUIDMAP"
+#define IDMAP_VERSION 1
+
+struct IdMapHeader {
+    char m_magic[8];
+    uint32_t m_version;
+    uint32_t m_count;
+    uint64_t m_records_off;
+    uint64_t m_groups_off;
+    uint64_t m_groups_count;
+    uint64_t m_strings_off;
+    uint64_t m_strings_len;
+};
+
+struct IdMapRecord {
+    uint64_t m_hash;
+    uint64_t m_name_off;    // Relative to the start of the strings section.
+    uint64_t m_groups_idx;  // Index of the first group in the groups section.
+    uint32_t m_name_len;
+    uint32_t m_uid;
+    uint32_t m_gid;
+    uint32_t m_ngroups;
+};
+
+// 64-bit FNV-1a; used to order and search the records.
+inline uint64_t
+IdMapHash(const char *name, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t idx = 0; idx < len; idx++) {
+        hash ^= static_cast<unsigned char>(name[idx]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+#endif
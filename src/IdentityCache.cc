@@ -0,0 +1,361 @@
+#include "IdentityCache.hh"
+#include "IdMap.hh"
+#include "IoClass.hh"
+#include "UserSentry.hh"
+
+#include "XrdSys/XrdSysError.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <iterator>
+#include <sstream>
+#include <thread>
+
+#include <grp.h>
+#include <pwd.h>
+#include <unistd.h>
+
+
+IdentityCache &
+IdentityCache::Instance()
+{
+    static IdentityCache cache;
+    return cache;
+}
+
+
+// Reject identities below multiuser.minuid / multiuser.mingid.
+static bool
+CheckMinimumIds(UserIdentity &identity)
+{
+    if (identity.m_uid < UserSentry::GetMinimumUid()) {
+        identity.m_status = UserIdentity::SystemUid;
+        return false;
+    }
+    if (identity.m_gid < UserSentry::GetMinimumGid()) {
+        identity.m_status = UserIdentity::SystemGid;
+        return false;
+    }
+    return true;
+}
+
+
+// Accept a resolved identity, attaching its multiuser.ioclass priority.
+static void
+SetValid(const std::string &username, UserIdentity &identity)
+{
+    identity.m_ioprio = IoClass::Instance().Lookup(username, identity);
+    identity.m_status = UserIdentity::Valid;
+}
+
+
+std::shared_ptr<UserIdentity>
+IdentityCache::Resolve(const std::string &username)
+{
+    std::shared_ptr<UserIdentity> identity(new UserIdentity());
+
+    // The local identity map, if configured, takes precedence over NSS.
+    auto &idmap = IdMap::Instance();
+    if (idmap.IsConfigured()) {
+        IdMap::Entry entry;
+        if (idmap.Lookup(username, entry)) {
+            identity->m_uid = entry.m_uid;
+            identity->m_gid = entry.m_gid;
+            if (!CheckMinimumIds(*identity)) {return identity;}
+            identity->m_groups.assign(entry.m_groups, entry.m_groups + entry.m_ngroups);
+            Instance().TrimGroups(*identity);
+            SetValid(username, *identity);
+            return identity;
+        }
+        if (idmap.IsExclusive()) {
+            identity->m_status = UserIdentity::NoSuchUser;
+            return identity;
+        }
+    }
+
+    struct passwd pwd, *result = nullptr;
+
+    int buflen = sysconf(_SC_GETPW_R_SIZE_MAX);
+    if (buflen < 0) {buflen = 16384;}
+    std::vector<char> buf(buflen);
+
+    int retval;
+    do {
+        retval = getpwnam_r(username.c_str(), &pwd, &buf[0], buflen, &result);
+        if ((result == nullptr) && (retval == ERANGE)) {
+            buflen *= 2;
+            buf.resize(buflen);
+            continue;
+        }
+        break;
+    } while (1);
+    if (result == nullptr) {
+        identity->m_status = retval ? UserIdentity::LookupFailed : UserIdentity::NoSuchUser;
+        identity->m_errno = retval;
+        return identity;
+    }
+    identity->m_uid = pwd.pw_uid;
+    identity->m_gid = pwd.pw_gid;
+    if (!CheckMinimumIds(*identity)) {return identity;}
+
+    // If no supplementary groups are kept at all, skip the NSS group lookup.
+    auto &cache = Instance();
+    if (!cache.m_max_groups) {
+        identity->m_groups.assign(1, pwd.pw_gid);
+        SetValid(username, *identity);
+        return identity;
+    }
+
+    // Get supplementary groups for user
+    int ngroups = 16;
+    std::vector<gid_t> groups(ngroups);
+    do {
+        int old_ngroups = ngroups;
+        retval = getgrouplist(username.c_str(), pwd.pw_gid, groups.data(), &ngroups);
+        if (-1 == retval && ngroups > old_ngroups) {
+            // Too many groups. Resize buffer and try again.
+            groups.resize(ngroups);
+            continue;
+        }
+        break;
+    } while (1);
+    if (-1 == retval) {
+        identity->m_status = UserIdentity::GroupsFailed;
+        return identity;
+    }
+    groups.resize(ngroups);
+    identity->m_groups.swap(groups);
+    cache.TrimGroups(*identity);
+    SetValid(username, *identity);
+    return identity;
+}
+
+
+std::shared_ptr<const UserIdentity>
+IdentityCache::Get(const std::string &username)
+{
+    if (!m_max_entries || (!m_positive_ttl.count() && !m_negative_ttl.count())) {
+        return Resolve(username);
+    }
+
+    // Results taken before the identity map was last replaced are stale.
+    auto generation = IdMap::Instance().Generation();
+    std::unique_lock<std::mutex> guard(m_mutex);
+    auto now = clock::now();
+    auto iter = m_entries.find(username);
+    while (iter != m_entries.end()) {
+        if (iter->second.m_pending) {
+            // Another thread is already performing the lookup; wait for it.
+            m_cv.wait(guard);
+            iter = m_entries.find(username);
+            now = clock::now();
+            continue;
+        }
+        if ((now < iter->second.m_expiry) && (iter->second.m_generation == generation)) {
+            m_lru.splice(m_lru.begin(), m_lru, iter->second.m_lru);
+            return iter->second.m_identity;
+        }
+        // Expired; we will become the thread performing the lookup.
+        break;
+    }
+
+    if (iter == m_entries.end()) {
+        if (!Evict(now)) {
+            guard.unlock();
+            return Resolve(username);
+        }
+        m_lru.push_front(username);
+        iter = m_entries.emplace(username, Entry()).first;
+        iter->second.m_lru = m_lru.begin();
+    } else {
+        m_lru.splice(m_lru.begin(), m_lru, iter->second.m_lru);
+    }
+    iter->second.m_pending = true;
+    guard.unlock();
+
+    std::shared_ptr<const UserIdentity> identity = Resolve(username);
+
+    guard.lock();
+    // The entry cannot have been evicted while pending.
+    iter = m_entries.find(username);
+    if (identity->IsTransient()) {
+        // Let the next request retry rather than deny the user for the
+        // negative TTL; waiting threads retry as well.
+        m_lru.erase(iter->second.m_lru);
+        m_entries.erase(iter);
+    } else {
+        auto ttl = identity->IsValid() ? m_positive_ttl : m_negative_ttl;
+        iter->second.m_identity = identity;
+        iter->second.m_expiry = clock::now() + ttl;
+        iter->second.m_generation = generation;
+        iter->second.m_pending = false;
+    }
+    guard.unlock();
+    m_cv.notify_all();
+
+    return identity;
+}
+
+
+bool
+IdentityCache::Evict(clock::time_point now)
+{
+    if (m_entries.size() < m_max_entries) {return true;}
+
+    // Prefer dropping expired entries; otherwise fall back to the least
+    // recently used entry that is not in the middle of a lookup.
+    auto victim = m_lru.end();
+    for (auto iter = m_lru.rbegin(); iter != m_lru.rend(); ++iter) {
+        const auto &entry = m_entries.find(*iter)->second;
+        if (entry.m_pending) {continue;}
+        if (victim == m_lru.end()) {victim = std::prev(iter.base());}
+        if (entry.m_expiry <= now) {
+            victim = std::prev(iter.base());
+            break;
+        }
+    }
+    if (victim == m_lru.end()) {return false;}
+    m_entries.erase(*victim);
+    m_lru.erase(victim);
+    return true;
+}
+
+
+void
+IdentityCache::Put(const std::string &username, const std::shared_ptr<const UserIdentity> &identity, unsigned generation)
+{
+    // Keep serving the previous result, if any, until it expires.
+    if (identity->IsTransient()) {return;}
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto now = clock::now();
+    auto iter = m_entries.find(username);
+    if (iter == m_entries.end()) {
+        if (!Evict(now)) {return;}
+        m_lru.push_front(username);
+        iter = m_entries.emplace(username, Entry()).first;
+        iter->second.m_lru = m_lru.begin();
+    } else if (iter->second.m_pending) {
+        return;
+    }
+    iter->second.m_identity = identity;
+    iter->second.m_expiry = now + (identity->IsValid() ? m_positive_ttl : m_negative_ttl);
+    iter->second.m_generation = generation;
+    iter->second.m_pending = false;
+}
+
+
+std::vector<std::string>
+IdentityCache::EnumerateAccounts()
+{
+    std::vector<std::string> accounts;
+    // getpwent is not thread-safe; this is only used while configuring.
+    setpwent();
+    struct passwd *pwd;
+    while ((pwd = getpwent())) {
+        if ((pwd->pw_uid < UserSentry::GetMinimumUid()) || (pwd->pw_gid < UserSentry::GetMinimumGid())) {
+            continue;
+        }
+        accounts.emplace_back(pwd->pw_name);
+    }
+    endpwent();
+    return accounts;
+}
+
+
+size_t
+IdentityCache::Warm(const std::vector<std::string> &usernames, XrdSysError &log)
+{
+    if (!m_max_entries || !m_positive_ttl.count()) {
+        log.Emsg("Config", "Identity cache is disabled; not pre-resolving user identities");
+        return 0;
+    }
+    if (!m_warm_users.empty()) {return 0;}
+
+    size_t valid = 0;
+    for (const auto &username : usernames) {
+        if (m_warm_users.size() >= m_max_entries) {
+            std::stringstream ss;
+            ss << "Too many accounts to pre-resolve; increase multiuser.idcache maxentries. Skipping "
+               << (usernames.size() - m_warm_users.size()) << " of " << usernames.size() << " accounts";
+            log.Emsg("Config", ss.str().c_str());
+            break;
+        }
+        auto generation = IdMap::Instance().Generation();
+        auto identity = Resolve(username);
+        Put(username, identity, generation);
+        m_warm_users.push_back(username);
+        if (identity->IsValid()) {valid++;}
+    }
+
+    std::stringstream ss;
+    ss << "Pre-resolved " << valid << " of " << m_warm_users.size() << " user identities";
+    log.Emsg("Config", ss.str().c_str());
+
+    if (!m_warm_users.empty()) {
+        std::thread refresh(&IdentityCache::RefreshLoop, this, &log);
+        refresh.detach();
+    }
+    return valid;
+}
+
+
+void
+IdentityCache::RefreshLoop(XrdSysError *log)
+{
+    // Re-resolve every warm user twice per TTL so their entries never expire.
+    auto period = m_positive_ttl / 2;
+    if (period.count() < 1) {period = std::chrono::seconds(1);}
+    while (true) {
+        std::this_thread::sleep_for(period);
+        for (const auto &username : m_warm_users) {
+            auto generation = IdMap::Instance().Generation();
+            auto identity = Resolve(username);
+            if (!identity->IsValid()) {
+                log->Emsg("IdentityCache", "Background refresh failed to resolve username", username.c_str());
+            }
+            Put(username, identity, generation);
+        }
+    }
+}
+
+
+void
+IdentityCache::TrimGroups(UserIdentity &identity)
+{
+    if (!HasGroupPolicy()) {return;}
+
+    std::vector<gid_t> kept;
+    kept.reserve(std::min(identity.m_groups.size(), m_max_groups) + 1);
+    kept.push_back(identity.m_gid);
+    for (auto gid : identity.m_groups) {
+        if (kept.size() > m_max_groups) {break;}
+        if (gid == identity.m_gid) {continue;}
+        if (!m_allowed_groups.empty() &&
+            std::none_of(m_allowed_groups.begin(), m_allowed_groups.end(),
+                [gid](const std::pair<gid_t, gid_t> &range) {return (gid >= range.first) && (gid <= range.second);}))
+        {
+            continue;
+        }
+        kept.push_back(gid);
+    }
+
+    // The original list normally includes the primary GID as well.
+    auto original = identity.m_groups.size();
+    if (std::find(identity.m_groups.begin(), identity.m_groups.end(), identity.m_gid) == identity.m_groups.end()) {
+        original++;
+    }
+    if (kept.size() < original) {
+        m_groups_dropped += original - kept.size();
+        m_identities_trimmed++;
+    }
+    identity.m_groups.swap(kept);
+}
+
+
+void
+IdentityCache::Stats(std::ostream &os) const
+{
+    os << "<idcache><trimmed>" << m_identities_trimmed.load()
+       << "</trimmed><groups_dropped>" << m_groups_dropped.load()
+       << "</groups_dropped></idcache>";
+}
@@ -0,0 +1,144 @@
+#ifndef __MULTIUSERIDENTITYCACHE_HH__
+#define __MULTIUSERIDENTITYCACHE_HH__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <ostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/types.h>
+
+class XrdSysError;
+
+
+/**
+ * The result of resolving a username through NSS: the UID, primary GID and
+ * supplementary groups, plus the verdict on whether the multiuser plugin
+ * may switch to this identity at all (e.g., it is not a system account).
+ */
+struct UserIdentity {
+    enum Status {
+        Valid,
+        NoSuchUser,      // getpwnam_r found no such user.
+        LookupFailed,    // getpwnam_r itself failed; see m_errno.
+        SystemUid,       // UID is below multiuser.minuid.
+        SystemGid,       // GID is below multiuser.mingid.
+        GroupsFailed     // getgrouplist failed.
+    };
+
+    Status m_status{LookupFailed};
+    int m_errno{0};
+    uid_t m_uid{0};
+    gid_t m_gid{0};
+    std::vector<gid_t> m_groups;
+    // I/O priority from multiuser.ioclass (see IoClass.hh); 0 if none.
+    int m_ioprio{0};
+
+    bool IsValid() const {return m_status == Valid;}
+    // A failure of the lookup itself (e.g., an LDAP timeout) rather than a
+    // verdict on the user; such results are never cached.
+    bool IsTransient() const {return (m_status == LookupFailed) || (m_status == GroupsFailed);}
+};
+
+
+/**
+ * A thread-safe, bounded cache of username -> UserIdentity.
+ *
+ * Positive and negative results are kept for separately-configured TTLs
+ * (multiuser.idcache); transient lookup failures are not kept at all.
+ * Concurrent misses for the same username are collapsed so only one thread
+ * performs the NSS lookup while the others wait on it.
+ */
+class IdentityCache {
+public:
+    static IdentityCache &Instance();
+
+    // Returns the (possibly cached) identity for a username; never null.
+    std::shared_ptr<const UserIdentity> Get(const std::string &username);
+
+    // Perform the NSS lookups for a username, bypassing the cache.
+    static std::shared_ptr<UserIdentity> Resolve(const std::string &username);
+
+    // Resolve the given usernames into the cache now and keep refreshing them
+    // from a background thread before they expire, so requests for these
+    // users never wait on NSS.  Returns the number of usable identities.
+    size_t Warm(const std::vector<std::string> &usernames, XrdSysError &log);
+
+    // List the accounts in the password database (getpwent) whose UID and GID
+    // are above the configured multiuser.minuid / multiuser.mingid.
+    static std::vector<std::string> EnumerateAccounts();
+
+    // Supplementary group trimming (multiuser.groups).  If any allowed ranges
+    // are configured, only groups within them are kept; at most `max_groups`
+    // groups besides the primary GID are kept.  The primary GID is always
+    // part of the group list.
+    void AllowGroups(gid_t first, gid_t last) {m_allowed_groups.emplace_back(first, last);}
+    void SetMaxGroups(size_t max_groups) {m_max_groups = max_groups;}
+    bool HasGroupPolicy() const {return !m_allowed_groups.empty() || (m_max_groups != m_unlimited_groups);}
+
+    // Append the cache's counters to a statistics report.
+    void Stats(std::ostream &os) const;
+
+    // A TTL of zero disables caching of that type of result.
+    void SetPositiveTTL(unsigned seconds) {m_positive_ttl = std::chrono::seconds(seconds);}
+    void SetNegativeTTL(unsigned seconds) {m_negative_ttl = std::chrono::seconds(seconds);}
+    void SetMaxEntries(size_t entries) {m_max_entries = entries;}
+    unsigned GetPositiveTTL() const {return m_positive_ttl.count();}
+    unsigned GetNegativeTTL() const {return m_negative_ttl.count();}
+    size_t GetMaxEntries() const {return m_max_entries;}
+
+private:
+    IdentityCache() {}
+    IdentityCache(const IdentityCache &) = delete;
+    IdentityCache &operator=(const IdentityCache &) = delete;
+
+    typedef std::chrono::steady_clock clock;
+
+    struct Entry {
+        std::shared_ptr<const UserIdentity> m_identity;
+        clock::time_point m_expiry;
+        // IdMap generation the identity was resolved against.
+        unsigned m_generation{0};
+        bool m_pending{true};
+        std::list<std::string>::iterator m_lru;
+    };
+
+    // Make room for a new entry; must be called with m_mutex held.  Returns
+    // false if the cache is full of lookups in progress.
+    bool Evict(clock::time_point now);
+
+    // Apply the multiuser.groups policy to a resolved group list.
+    void TrimGroups(UserIdentity &identity);
+
+    // Store a freshly-resolved identity unless a lookup is in flight.
+    void Put(const std::string &username, const std::shared_ptr<const UserIdentity> &identity, unsigned generation);
+
+    void RefreshLoop(XrdSysError *log);
+
+    std::chrono::seconds m_positive_ttl{60};
+    std::chrono::seconds m_negative_ttl{10};
+    size_t m_max_entries{4096};
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::unordered_map<std::string, Entry> m_entries;
+    // Most-recently-used usernames are at the front.
+    std::list<std::string> m_lru;
+
+    // Usernames kept fresh by the refresh thread; fixed once it is started.
+    std::vector<std::string> m_warm_users;
+
+    static const size_t m_unlimited_groups = static_cast<size_t>(-1);
+    std::vector<std::pair<gid_t, gid_t>> m_allowed_groups;
+    size_t m_max_groups{m_unlimited_groups};
+    std::atomic<unsigned long long> m_groups_dropped{0};
+    std::atomic<unsigned long long> m_identities_trimmed{0};
+};
+
+#endif
@@ -0,0 +1,186 @@
+#include "IdentityWorkerPool.hh"
+
+#include <algorithm>
+#include <sstream>
+
+IdentityWorkerPool *IdentityWorkerPool::m_pool = nullptr;
+thread_local bool IdentityWorkerPool::m_in_worker = false;
+const unsigned IdentityWorkerPool::m_yield_after;
+
+
+unsigned
+IdentityWorkerPool::DefaultMaxPerUser(unsigned threads, unsigned max_per_user)
+{
+    if (!max_per_user) {max_per_user = (threads + 3) / 4;}
+    return std::min(max_per_user, threads);
+}
+
+
+IdentityWorkerPool *
+IdentityWorkerPool::Configure(unsigned threads, unsigned max_per_user, XrdSysError &log)
+{
+    if (m_pool || !threads) {return m_pool;}
+    max_per_user = DefaultMaxPerUser(threads, max_per_user);
+    m_pool = new IdentityWorkerPool(threads, max_per_user, log);
+    UserSentry::SetDispatchEnabled(true);
+
+    std::stringstream ss;
+    ss << "Running filesystem operations on " << threads << " identity-pinned worker threads (at most "
+       << max_per_user << " per user)";
+    log.Emsg("Config", ss.str().c_str());
+    return m_pool;
+}
+
+
+IdentityWorkerPool *
+IdentityWorkerPool::Create(unsigned threads, unsigned max_per_user, XrdSysError &log)
+{
+    if (!threads) {return nullptr;}
+    max_per_user = DefaultMaxPerUser(threads, max_per_user);
+    return new IdentityWorkerPool(threads, max_per_user, log);
+}
+
+
+IdentityWorkerPool::IdentityWorkerPool(unsigned threads, unsigned max_per_user, XrdSysError &log) :
+    m_max_per_user(max_per_user),
+    m_log(log)
+{
+    for (unsigned idx = 0; idx < threads; idx++) {
+        m_workers.emplace_back(new Worker());
+        std::thread worker(&IdentityWorkerPool::WorkerLoop, this, m_workers.back().get());
+        worker.detach();
+    }
+}
+
+
+void
+IdentityWorkerPool::Pin(Worker *worker, Queue *queue)
+{
+    auto old_queue = worker->m_queue;
+    if (old_queue == queue) {return;}
+    worker->m_queue = queue;
+    queue->m_workers++;
+    if (!old_queue) {return;}
+    old_queue->m_workers--;
+    if (!old_queue->m_workers && old_queue->m_tasks.empty() && !old_queue->m_starved) {
+        m_queues.erase(Key(*old_queue->m_identity));
+    }
+}
+
+
+void
+IdentityWorkerPool::Starve(Queue *queue)
+{
+    if ((queue->m_workers < m_max_per_user) && !queue->m_starved) {
+        queue->m_starved = true;
+        m_starved.push_back(queue);
+    }
+}
+
+
+void
+IdentityWorkerPool::Submit(const std::shared_ptr<const UserIdentity> &identity, Task task)
+{
+    std::unique_lock<std::mutex> guard(m_mutex);
+    auto &queue = m_queues[Key(*identity)];
+    if (!queue.m_identity) {queue.m_identity = identity;}
+    queue.m_tasks.push_back(std::move(task));
+
+    // Prefer an idle worker which already holds this identity.
+    Worker *worker = nullptr;
+    for (auto iter = m_idle.begin(); iter != m_idle.end(); ++iter) {
+        if ((*iter)->m_queue == &queue) {
+            worker = *iter;
+            m_idle.erase(iter);
+            break;
+        }
+    }
+    // Otherwise, re-pin the least recently used idle worker.
+    if (!worker && (queue.m_workers < m_max_per_user) && !m_idle.empty()) {
+        worker = m_idle.back();
+        m_idle.pop_back();
+        Pin(worker, &queue);
+    }
+    if (worker) {
+        worker->m_idle = false;
+        guard.unlock();
+        worker->m_cv.notify_one();
+        return;
+    }
+    // No worker free right now; the next one to go idle, or to yield, will
+    // help out.
+    Starve(&queue);
+}
+
+
+void
+IdentityWorkerPool::Run(const std::shared_ptr<const UserIdentity> &identity, const Task &task)
+{
+    // Waiting on the pool from one of its own workers could deadlock; run
+    // nested operations inline instead.
+    if (m_in_worker) {
+        task(UserSentry::ThreadCaps(m_log) && UserSentry::HoldThreadIdentity(identity, nullptr, m_log));
+        return;
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+    Submit(identity, [&](bool ok) {
+        task(ok);
+        std::lock_guard<std::mutex> guard(mutex);
+        done = true;
+        cv.notify_one();
+    });
+    std::unique_lock<std::mutex> guard(mutex);
+    cv.wait(guard, [&] {return done;});
+}
+
+
+void
+IdentityWorkerPool::WorkerLoop(Worker *worker)
+{
+    m_in_worker = true;
+    bool have_caps = UserSentry::ThreadCaps(m_log);
+    // Tasks run in a row from the current queue.
+    unsigned streak = 0;
+    std::unique_lock<std::mutex> guard(m_mutex);
+    while (true) {
+        auto queue = worker->m_queue;
+        if (queue && !queue->m_tasks.empty() && ((streak < m_yield_after) || m_starved.empty())) {
+            streak++;
+            Task task(std::move(queue->m_tasks.front()));
+            queue->m_tasks.pop_front();
+            auto identity = queue->m_identity;
+            guard.unlock();
+
+            bool ok = have_caps && UserSentry::HoldThreadIdentity(identity, nullptr, m_log);
+            task(ok);
+
+            guard.lock();
+            continue;
+        }
+
+        // Help an identity which is waiting for a worker.  A worker leaving
+        // tasks behind puts its own queue in line for the next free worker.
+        if (!m_starved.empty()) {
+            auto starved = m_starved.front();
+            m_starved.pop_front();
+            starved->m_starved = false;
+            if (!starved->m_tasks.empty() && (starved->m_workers < m_max_per_user)) {
+                bool left_tasks = queue && !queue->m_tasks.empty();
+                Pin(worker, starved);
+                streak = 0;
+                if (left_tasks) {Starve(queue);}
+            } else if (!starved->m_workers && starved->m_tasks.empty()) {
+                m_queues.erase(Key(*starved->m_identity));
+            }
+            continue;
+        }
+
+        streak = 0;
+        worker->m_idle = true;
+        m_idle.push_front(worker);
+        worker->m_cv.wait(guard, [&] {return !worker->m_idle;});
+    }
+}
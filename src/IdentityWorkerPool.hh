@@ -0,0 +1,143 @@
+#ifndef __MULTIUSERIDENTITYWORKERPOOL_HH__
+#define __MULTIUSERIDENTITYWORKERPOOL_HH__
+
+#include "UserSentry.hh"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/**
+ * A pool of worker threads which each hold a user's filesystem credentials
+ * (multiuser.workerpool).
+ *
+ * Operations are queued per identity (UID, GID, groups and I/O priority,
+ * so a refreshed identity keeps its queue).  A task runs on a worker already
+ * pinned to its identity when possible; otherwise the least-recently-idle
+ * worker is re-pinned to it.  Workers take tasks from their own identity's
+ * queue, so the credential switch happens only when a worker is re-pinned.
+ * At most `max_per_user` workers (default: a quarter of the pool) serve any
+ * single identity, and a worker which has run a few tasks in a row moves on
+ * to an identity waiting for a worker, so a busy user cannot hold back the
+ * others for long.
+ */
+class IdentityWorkerPool {
+public:
+    // A task is told whether the worker holds the requested identity; if
+    // not, it must fail without touching the filesystem.
+    typedef std::function<void(bool)> Task;
+
+    // Start the process-wide pool; returns null if it is not configured.
+    static IdentityWorkerPool *Configure(unsigned threads, unsigned max_per_user, XrdSysError &log);
+    static IdentityWorkerPool *Get() {return m_pool;}
+
+    // Start a separate pool, e.g. for asynchronous I/O completions.  Unlike
+    // Configure, this does not make UserSentry dispatch operations to it.
+    static IdentityWorkerPool *Create(unsigned threads, unsigned max_per_user, XrdSysError &log);
+
+    // Queue a task to run as the given identity.
+    void Submit(const std::shared_ptr<const UserIdentity> &identity, Task task);
+
+    // Run a task as the given identity and wait for it to complete.
+    void Run(const std::shared_ptr<const UserIdentity> &identity, const Task &task);
+
+    unsigned GetThreads() const {return m_workers.size();}
+
+private:
+    IdentityWorkerPool(unsigned threads, unsigned max_per_user, XrdSysError &log);
+
+    struct Queue;
+
+    struct Worker {
+        std::condition_variable m_cv;
+        Queue *m_queue{nullptr};
+        bool m_idle{false};
+    };
+
+    struct Queue {
+        std::shared_ptr<const UserIdentity> m_identity;
+        std::deque<Task> m_tasks;
+        unsigned m_workers{0};
+        bool m_starved{false};
+    };
+
+    // Identities which switch to the same credentials share a queue.
+    struct Key {
+        uid_t m_uid;
+        gid_t m_gid;
+        std::vector<gid_t> m_groups;
+        int m_ioprio;
+
+        explicit Key(const UserIdentity &identity) :
+            m_uid(identity.m_uid),
+            m_gid(identity.m_gid),
+            m_groups(identity.m_groups),
+            m_ioprio(identity.m_ioprio)
+        {}
+
+        bool operator<(const Key &other) const
+        {
+            if (m_uid != other.m_uid) {return m_uid < other.m_uid;}
+            if (m_gid != other.m_gid) {return m_gid < other.m_gid;}
+            if (m_ioprio != other.m_ioprio) {return m_ioprio < other.m_ioprio;}
+            return m_groups < other.m_groups;
+        }
+    };
+
+    static unsigned DefaultMaxPerUser(unsigned threads, unsigned max_per_user);
+
+    void WorkerLoop(Worker *worker);
+
+    // Mark a queue as waiting for a worker; must be called with m_mutex held.
+    void Starve(Queue *queue);
+
+    // Move a worker to a new queue; must be called with m_mutex held.
+    void Pin(Worker *worker, Queue *queue);
+
+    // A worker with tasks left in its own queue runs at most this many in a
+    // row before moving on to a starved queue.
+    static const unsigned m_yield_after = 8;
+
+    const unsigned m_max_per_user;
+    XrdSysError &m_log;
+
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::map<Key, Queue> m_queues;
+    // Idle workers; the most recently idle is at the front.
+    std::list<Worker *> m_idle;
+    // Queues with pending tasks which could use another worker.
+    std::deque<Queue *> m_starved;
+
+    static IdentityWorkerPool *m_pool;
+    static thread_local bool m_in_worker;
+};
+
+
+/**
+ * Run an operation as the user a UserSentry (constructed with
+ * UserSentry::Dispatch) resolved.  If the sentry switched the calling
+ * thread's credentials itself, or the client is anonymous, the operation runs
+ * inline; otherwise it runs on the identity worker pool.
+ */
+template<typename F>
+auto RunAsUser(const UserSentry *sentry, F fn) -> decltype(fn())
+{
+    auto pool = IdentityWorkerPool::Get();
+    if (!pool || !sentry || !sentry->DispatchIdentity()) {return fn();}
+    decltype(fn()) result;
+    pool->Run(sentry->DispatchIdentity(), [&](bool ok) {
+        if (ok) {result = fn();}
+        else {result = -EACCES;}
+    });
+    return result;
+}
+
+#endif
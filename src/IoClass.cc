@@ -0,0 +1,89 @@
+#include "IoClass.hh"
+
+#include "XrdSys/XrdSysError.hh"
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Not exported by glibc; see ioprio_set(2).
+#define MULTIUSER_IOPRIO_WHO_PROCESS 1
+
+std::atomic<bool> IoClass::m_warned{false};
+
+
+IoClass &
+IoClass::Instance()
+{
+    static IoClass ioclass;
+    return ioclass;
+}
+
+
+bool
+IoClass::ParseClass(const char *name, Class &ioclass)
+{
+    if (!strcmp("realtime", name) || !strcmp("rt", name)) {ioclass = Realtime;}
+    else if (!strcmp("best-effort", name) || !strcmp("be", name)) {ioclass = BestEffort;}
+    else if (!strcmp("idle", name)) {ioclass = Idle;}
+    else {return false;}
+    return true;
+}
+
+
+const char *
+IoClass::ClassName(int ioprio)
+{
+    switch (ioprio >> m_class_shift) {
+    case Realtime:
+        return "realtime";
+    case BestEffort:
+        return "best-effort";
+    case Idle:
+        return "idle";
+    }
+    return "none";
+}
+
+
+int
+IoClass::Lookup(const std::string &username, const UserIdentity &identity) const
+{
+    auto user = m_users.find(username);
+    if (user != m_users.end()) {return user->second;}
+    auto group = m_groups.find(identity.m_gid);
+    if (group != m_groups.end()) {return group->second;}
+    for (auto gid : identity.m_groups) {
+        group = m_groups.find(gid);
+        if (group != m_groups.end()) {return group->second;}
+    }
+    return 0;
+}
+
+
+int
+IoClass::Set(int ioprio, XrdSysError &log)
+{
+    // A `who` of 0 is the calling thread, not the whole process.
+    int orig = syscall(SYS_ioprio_get, MULTIUSER_IOPRIO_WHO_PROCESS, 0);
+    if (orig < 0) {orig = 0;}
+    if (orig == ioprio) {return -1;}
+    if (syscall(SYS_ioprio_set, MULTIUSER_IOPRIO_WHO_PROCESS, 0, ioprio)) {
+        if (!m_warned.exchange(true)) {
+            log.Emsg("IoClass", "Failed to set the I/O priority of a worker thread to class", ClassName(ioprio), strerror(errno));
+        }
+        return -1;
+    }
+    return orig;
+}
+
+
+void
+IoClass::Restore(int ioprio, XrdSysError &log)
+{
+    if (syscall(SYS_ioprio_set, MULTIUSER_IOPRIO_WHO_PROCESS, 0, ioprio)) {
+        log.Emsg("IoClass", "Failed to return the I/O priority to its original state", strerror(errno));
+    }
+}
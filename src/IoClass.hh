@@ -0,0 +1,99 @@
+#ifndef __MULTIUSERIOCLASS_HH__
+#define __MULTIUSERIOCLASS_HH__
+
+#include "IdentityCache.hh"
+
+#include <atomic>
+#include <map>
+#include <string>
+
+#include <sys/types.h>
+
+class XrdSysError;
+
+
+/**
+ * Block-layer I/O priorities per user or group (multiuser.ioclass).
+ *
+ * The priority for a user is worked out once, when its identity is resolved,
+ * and kept in UserIdentity::m_ioprio; a UserSentry applies it to the calling
+ * thread with ioprio_set alongside the fsuid switch and puts the thread's
+ * previous priority back when it releases the identity.  Reads and writes on
+ * an open file run without a sentry, so MultiuserFile holds the opener's
+ * priority around each of them with an IoPriorityGuard.  A mapping for the
+ * username wins over one for its primary group, which wins over those for
+ * its supplementary groups (in the order NSS returned them).
+ *
+ * Priorities only matter to schedulers which honour them (BFQ, and CFQ on
+ * older kernels); the realtime class needs CAP_SYS_ADMIN or CAP_SYS_NICE.
+ */
+class IoClass {
+public:
+    enum Class {
+        None = 0,
+        Realtime = 1,
+        BestEffort = 2,
+        Idle = 3
+    };
+
+    static IoClass &Instance();
+
+    // Parse a class name (realtime / rt, best-effort / be, idle); returns
+    // false if it is unknown.
+    static bool ParseClass(const char *name, Class &ioclass);
+    static const char *ClassName(int ioprio);
+    static int Encode(Class ioclass, unsigned level) {return (ioclass << m_class_shift) | (level & 7);}
+
+    void SetUser(const std::string &username, int ioprio) {m_users[username] = ioprio;}
+    void SetGroup(gid_t gid, int ioprio) {m_groups[gid] = ioprio;}
+    bool IsEnabled() const {return !m_users.empty() || !m_groups.empty();}
+    size_t GetUserCount() const {return m_users.size();}
+    size_t GetGroupCount() const {return m_groups.size();}
+
+    // The priority configured for a resolved identity; 0 if there is none.
+    int Lookup(const std::string &username, const UserIdentity &identity) const;
+
+    // Switch the calling thread to `ioprio`.  Returns the thread's previous
+    // priority, or -1 if it was left unchanged.
+    static int Set(int ioprio, XrdSysError &log);
+    static void Restore(int ioprio, XrdSysError &log);
+
+private:
+    IoClass() {}
+    IoClass(const IoClass &) = delete;
+    IoClass &operator=(const IoClass &) = delete;
+
+    static const int m_class_shift = 13;
+
+    // Fixed after configuration.
+    std::map<std::string, int> m_users;
+    std::map<gid_t, int> m_groups;
+
+    // Only the first failure to set a priority is logged.
+    static std::atomic<bool> m_warned;
+};
+
+
+// Runs the calling thread at `ioprio` (if non-zero) for the guard's lifetime.
+class IoPriorityGuard {
+public:
+    IoPriorityGuard(int ioprio, XrdSysError &log) :
+        m_log(log)
+    {
+        if (ioprio) {m_orig_ioprio = IoClass::Set(ioprio, log);}
+    }
+
+    ~IoPriorityGuard()
+    {
+        if (m_orig_ioprio != -1) {IoClass::Restore(m_orig_ioprio, m_log);}
+    }
+
+private:
+    IoPriorityGuard(const IoPriorityGuard &) = delete;
+    IoPriorityGuard &operator=(const IoPriorityGuard &) = delete;
+
+    XrdSysError &m_log;
+    int m_orig_ioprio{-1};
+};
+
+#endif
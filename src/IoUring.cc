@@ -0,0 +1,318 @@
+#include "IoUring.hh"
+
+#include "XrdOuc/XrdOucIOVec.hh"
+#include "XrdSys/XrdSysError.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+
+#include <unistd.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// Older C libraries do not know the syscall numbers; they are the same on
+// every architecture using the generic syscall table.
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+#endif
+
+unsigned IoUring::m_depth = 0;
+bool IoUring::m_have_statx = false;
+thread_local std::unique_ptr<IoUring> IoUring::m_thread_ring;
+thread_local bool IoUring::m_thread_failed = false;
+
+
+IoUring *
+IoUring::ThreadRing()
+{
+    if (!m_depth) {return nullptr;}
+    if (m_thread_ring) {
+        if (!m_thread_ring->m_broken) {return m_thread_ring.get();}
+        return nullptr;
+    }
+    if (m_thread_failed) {return nullptr;}
+
+    std::unique_ptr<IoUring> ring(new IoUring());
+    if (ring->Init(m_depth)) {
+        // Do not retry on every operation, e.g. if we hit RLIMIT_MEMLOCK.
+        m_thread_failed = true;
+        return nullptr;
+    }
+    m_thread_ring = std::move(ring);
+    return m_thread_ring.get();
+}
+
+
+#ifdef HAVE_IO_URING
+
+bool
+IoUring::Configure(unsigned depth, XrdSysError &log)
+{
+    if (!depth) {
+        m_depth = 0;
+        return true;
+    }
+
+    // Probe with a throwaway ring; io_uring may be compiled out or disabled
+    // (kernel.io_uring_disabled, seccomp) even when the headers exist.
+    IoUring ring;
+    int rc = ring.Init(depth);
+    if (rc) {
+        log.Emsg("Config", -rc, "create an io_uring; multiuser.iouring is disabled");
+        return false;
+    }
+
+    // IORING_OP_READ / IORING_OP_WRITE need Linux 5.6; so does the probe.
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    std::unique_ptr<char[]> probe_buf(new char[probe_size]);
+    memset(probe_buf.get(), 0, probe_size);
+    auto probe = reinterpret_cast<struct io_uring_probe *>(probe_buf.get());
+    if ((syscall(__NR_io_uring_register, ring.m_fd, IORING_REGISTER_PROBE, probe, 256) < 0) ||
+        (probe->last_op < IORING_OP_WRITE) ||
+        !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) ||
+        !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED))
+    {
+        log.Emsg("Config", "Kernel io_uring does not support read and write operations; multiuser.iouring is disabled");
+        return false;
+    }
+
+    m_have_statx = (probe->last_op >= IORING_OP_STATX) && (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+    m_depth = depth;
+    std::stringstream ss;
+    ss << "Submitting vector reads and writes through io_uring with a queue depth of " << ring.m_entries;
+    log.Emsg("Config", ss.str().c_str());
+    return true;
+}
+
+
+int
+IoUring::Init(unsigned depth)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    m_fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (m_fd < 0) {
+        m_fd = -1;
+        return -errno;
+    }
+    m_entries = params.sq_entries;
+
+    m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        if (m_cq_ring_size > m_sq_ring_size) {m_sq_ring_size = m_cq_ring_size;}
+        m_cq_ring_size = m_sq_ring_size;
+    }
+
+    m_sq_ring = mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, IORING_OFF_SQ_RING);
+    if (m_sq_ring == MAP_FAILED) {
+        m_sq_ring = nullptr;
+        return -errno;
+    }
+    if (single_mmap) {
+        m_cq_ring = m_sq_ring;
+    } else {
+        m_cq_ring = mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, IORING_OFF_CQ_RING);
+        if (m_cq_ring == MAP_FAILED) {
+            m_cq_ring = nullptr;
+            return -errno;
+        }
+    }
+    m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED) {
+        m_sqes = nullptr;
+        return -errno;
+    }
+
+    auto sq = static_cast<char *>(m_sq_ring);
+    m_sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    m_sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    m_sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    m_sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    auto cq = static_cast<char *>(m_cq_ring);
+    m_cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    m_cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    m_cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    m_cqes = cq + params.cq_off.cqes;
+    return 0;
+}
+
+
+IoUring::~IoUring()
+{
+    if (m_sqes) {munmap(m_sqes, m_sqes_size);}
+    if (m_cq_ring && (m_cq_ring != m_sq_ring)) {munmap(m_cq_ring, m_cq_ring_size);}
+    if (m_sq_ring) {munmap(m_sq_ring, m_sq_ring_size);}
+    if (m_fd >= 0) {close(m_fd);}
+}
+
+
+// Finish a segment the kernel only partially transferred.
+static ssize_t
+CompleteSegment(int fd, XrdOucIOVec &seg, ssize_t done, bool write)
+{
+    while (done < seg.size) {
+        ssize_t rc = write ? pwrite(fd, seg.data + done, seg.size - done, seg.offset + done)
+                           : pread(fd, seg.data + done, seg.size - done, seg.offset + done);
+        if (rc < 0) {
+            if (errno == EINTR) {continue;}
+            return -errno;
+        }
+        if (rc == 0) {return write ? -EIO : -ESPIPE;}
+        done += rc;
+    }
+    return done;
+}
+
+
+template<typename Prep, typename Complete>
+int
+IoUring::Batch(int count, Prep prep, Complete complete)
+{
+    auto sqes = static_cast<struct io_uring_sqe *>(m_sqes);
+    auto cqes = static_cast<struct io_uring_cqe *>(m_cqes);
+
+    int next = 0;
+    unsigned inflight = 0;
+    unsigned tail = *m_sq_tail;
+    while ((next < count) || inflight) {
+        // Queue as many requests as the ring has room for.
+        while ((next < count) && (inflight < m_entries)) {
+            unsigned idx = tail & m_sq_mask;
+            auto sqe = &sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            prep(next, sqe);
+            sqe->user_data = next;
+            m_sq_array[idx] = idx;
+            tail++;
+            next++;
+            inflight++;
+        }
+        __atomic_store_n(m_sq_tail, tail, __ATOMIC_RELEASE);
+
+        unsigned to_submit = tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+        if (syscall(__NR_io_uring_enter, m_fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0) {
+            if ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY)) {continue;}
+            // The kernel may still own some of the caller's buffers; stop
+            // using this ring rather than guessing.
+            m_broken = true;
+            return -errno;
+        }
+
+        unsigned head = *m_cq_head;
+        unsigned cq_tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != cq_tail; head++) {
+            const auto &cqe = cqes[head & m_cq_mask];
+            inflight--;
+            // On failure, stop queueing but wait for what is already in flight.
+            if (!complete(static_cast<int>(cqe.user_data), cqe.res)) {next = count;}
+        }
+        __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+
+ssize_t
+IoUring::Transfer(int fd, XrdOucIOVec *iov, int count, bool write)
+{
+    ssize_t total = 0;
+    int error = 0;
+    auto prep = [&](int idx, struct io_uring_sqe *sqe) {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uintptr_t>(iov[idx].data);
+        sqe->len = iov[idx].size;
+        sqe->off = iov[idx].offset;
+    };
+    auto complete = [&](int idx, ssize_t rc) {
+        if (error) {return false;}
+        auto &seg = iov[idx];
+        if ((rc >= 0) && (rc < seg.size)) {
+            rc = CompleteSegment(fd, seg, rc, write);
+        }
+        if (rc < 0) {
+            error = -rc;
+            return false;
+        }
+        total += rc;
+        return true;
+    };
+    int rc = Batch(count, prep, complete);
+    if (rc) {return rc;}
+    return error ? -error : total;
+}
+
+
+int
+IoUring::Statx(int dirfd, const char *const *names, int count, int flags, struct statx *results, int *rcs)
+{
+    if (!m_have_statx) {return -ENOSYS;}
+    auto prep = [&](int idx, struct io_uring_sqe *sqe) {
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dirfd;
+        sqe->addr = reinterpret_cast<uintptr_t>(names[idx]);
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = reinterpret_cast<uintptr_t>(&results[idx]);
+        sqe->statx_flags = flags;
+    };
+    auto complete = [&](int idx, int rc) {
+        rcs[idx] = rc;
+        return true;
+    };
+    return Batch(count, prep, complete);
+}
+
+#else
+
+bool
+IoUring::Configure(unsigned depth, XrdSysError &log)
+{
+    m_depth = 0;
+    if (depth) {
+        log.Emsg("Config", "multiuser.iouring is not supported by this build; ignoring");
+    }
+    return !depth;
+}
+
+
+int
+IoUring::Init(unsigned)
+{
+    return -ENOSYS;
+}
+
+
+IoUring::~IoUring()
+{
+}
+
+
+ssize_t
+IoUring::Transfer(int, XrdOucIOVec *, int, bool)
+{
+    return -ENOSYS;
+}
+
+
+int
+IoUring::Statx(int, const char *const *, int, int, struct statx *, int *)
+{
+    return -ENOSYS;
+}
+
+#endif
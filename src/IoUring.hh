@@ -0,0 +1,100 @@
+#ifndef __MULTIUSERIOURING_HH__
+#define __MULTIUSERIOURING_HH__
+
+#include <cstdint>
+#include <memory>
+
+#include <sys/types.h>
+
+class XrdSysError;
+struct XrdOucIOVec;
+struct statx;
+
+
+/**
+ * A minimal io_uring submission engine (multiuser.iouring).
+ *
+ * Each thread lazily creates its own ring; vector reads and writes against
+ * the wrapped OSS's file descriptor are submitted as one batch so all the
+ * segments are in flight at once instead of being issued one pread at a time.
+ * Directory listings use it the same way to look up entry attributes.
+ * Because this goes around the wrapped OSS's ReadV / WriteV, it is only
+ * enabled when the wrapped OSS is the default one.  Opens and single reads
+ * and writes are not submitted through the ring, and requests run with the
+ * submitting thread's credentials rather than registered personalities.
+ *
+ * Only built when the kernel headers provide <linux/io_uring.h>; otherwise
+ * Configure() reports the engine as unavailable and callers keep using the
+ * wrapped OSS.
+ */
+class IoUring {
+public:
+    // Enable the engine with the given per-thread queue depth.  Probes the
+    // running kernel; returns false (and logs why) if io_uring cannot be used.
+    static bool Configure(unsigned depth, XrdSysError &log);
+    static bool IsEnabled() {return m_depth != 0;}
+
+    // Returns the calling thread's ring, or null if the engine is disabled or
+    // the ring could not be created.
+    static IoUring *ThreadRing();
+
+    // Same semantics as XrdOssDF::ReadV / WriteV: every segment must be
+    // transferred in full.  Returns the total number of bytes transferred, or
+    // a negative errno (-ESPIPE for a read past the end of the file).
+    ssize_t ReadV(int fd, XrdOucIOVec *readV, int count) {return Transfer(fd, readV, count, false);}
+    ssize_t WriteV(int fd, XrdOucIOVec *writeV, int count) {return Transfer(fd, writeV, count, true);}
+
+    // Look up attributes of entries in a directory, as statx(dirfd, names[i],
+    // flags, STATX_BASIC_STATS, &results[i]), all submitted at once.  Each
+    // entry's outcome (0 or a negative errno) is stored in rcs[i].  Returns
+    // 0, or a negative errno if the batch could not be run at all.
+    int Statx(int dirfd, const char *const *names, int count, int flags, struct statx *results, int *rcs);
+
+    ~IoUring();
+
+private:
+    IoUring() {}
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    // Returns 0 or a negative errno.
+    int Init(unsigned depth);
+    ssize_t Transfer(int fd, XrdOucIOVec *iov, int count, bool write);
+
+    // Submit `count` operations, keeping up to m_entries in flight.
+    // prep(idx, sqe) fills in the idx'th request; complete(idx, res) is
+    // called with its result.  If complete() returns false, no further
+    // requests are submitted.  Returns 0 or a negative errno.
+    template<typename Prep, typename Complete>
+    int Batch(int count, Prep prep, Complete complete);
+
+    int m_fd{-1};
+    unsigned m_entries{0};
+
+    // Mappings of the submission queue, completion queue and SQE array.
+    void *m_sq_ring{nullptr};
+    size_t m_sq_ring_size{0};
+    void *m_cq_ring{nullptr};
+    size_t m_cq_ring_size{0};
+    void *m_sqes{nullptr};
+    size_t m_sqes_size{0};
+
+    unsigned *m_sq_head{nullptr};
+    unsigned *m_sq_tail{nullptr};
+    unsigned m_sq_mask{0};
+    unsigned *m_sq_array{nullptr};
+    unsigned *m_cq_head{nullptr};
+    unsigned *m_cq_tail{nullptr};
+    unsigned m_cq_mask{0};
+    void *m_cqes{nullptr};
+
+    // Set if the ring got into an unknown state; it is no longer used.
+    bool m_broken{false};
+
+    static unsigned m_depth;
+    static bool m_have_statx;
+    static thread_local std::unique_ptr<IoUring> m_thread_ring;
+    static thread_local bool m_thread_failed;
+};
+
+#endif
@@ -4,14 +4,23 @@
 #include "XrdOuc/XrdOucEnv.hh"
 #include "XrdOss/XrdOss.hh"
 #include "UserSentry.hh"
+#include "IdentityWorkerPool.hh"
+#include "DirectoryReader.hh"
+#include "MultiuserFileSystem.hh"
+
+#include <memory>
+#include <string>
+
+#include <sys/param.h>
 
 
 class MultiuserDirectory : public XrdOssDF {
 public:
-    MultiuserDirectory(const char *user, std::unique_ptr<XrdOssDF> ossDF, XrdSysError &log) :
+    MultiuserDirectory(const char *user, std::unique_ptr<XrdOssDF> ossDF, XrdSysError &log, MultiuserFileSystem *oss) :
         XrdOssDF(user),
         m_wrappedDir(std::move(ossDF)),
-        m_log(log)
+        m_log(log),
+        m_oss(oss)
     {
     }
 
@@ -23,25 +32,46 @@ public:
     {
         //ErrorSentry err_sentry(error, m_oss->error);
         m_client = env.secEnv();
-        UserSentry sentry(m_client, m_log);
+        UserSentry sentry(m_client, m_log, UserSentry::Dispatch);
         if (!sentry.IsValid()) {return -EACCES;}
-        return m_wrappedDir->Opendir(path, env);
+        // Resolve the client once; every Readdir on this handle reuses it.
+        m_resolution = sentry.GetResolution();
+        int rc = RunAsUser(&sentry, [&] {return m_wrappedDir->Opendir(path, env);});
+        if (!rc && DirectoryReader::IsEnabled()) {
+            char pfn[MAXPATHLEN + 1];
+            if (!m_oss->Lfn2Pfn(path, pfn, sizeof(pfn))) {m_pfn = pfn;}
+        }
+        return rc;
     }
 
     int Readdir(char *buff, int blen) 
     {
-        UserSentry sentry(m_client, m_log);
+        UserSentry sentry(m_resolution, m_log, UserSentry::Dispatch);
         if (!sentry.IsValid()) {return -EACCES;}
-        return m_wrappedDir->Readdir(buff, blen);
+        return RunAsUser(&sentry, [&] {
+            // Extended listings are served from batched getdents64/statx
+            // (multiuser.readdirplus); fall back to the wrapped directory if
+            // we cannot open it ourselves.
+            if (m_stat && !m_pfn.empty() && !m_reader) {
+                std::unique_ptr<DirectoryReader> reader(new DirectoryReader());
+                if (!reader->Open(m_pfn.c_str())) {m_reader = std::move(reader);}
+                m_pfn.clear();
+            }
+            if (m_reader) {return m_reader->Next(buff, blen, m_stat);}
+            return m_wrappedDir->Readdir(buff, blen);
+        });
     }
 
     int StatRet(struct stat *statStruct) 
     {
-        return m_wrappedDir->StatRet(statStruct);
+        int rc = m_wrappedDir->StatRet(statStruct);
+        if (!rc) {m_stat = statStruct;}
+        return rc;
     }
 
     int Close(long long *retsz=0) 
     {
+        m_reader.reset();
         return m_wrappedDir->Close(retsz);
     }
 
@@ -50,6 +80,13 @@ private:
     std::unique_ptr<XrdOssDF> m_wrappedDir;
     XrdSysError m_log;
     const XrdSecEntity* m_client;
+    UserSentry::Resolution m_resolution;
+    MultiuserFileSystem *m_oss;
+    // Physical path of the directory, kept only while a DirectoryReader may
+    // still be needed.
+    std::string m_pfn;
+    struct stat *m_stat{nullptr};
+    std::unique_ptr<DirectoryReader> m_reader;
 
 };
 
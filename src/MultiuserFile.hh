@@ -13,12 +13,24 @@
 #include "XrdCks/XrdCksWrapper.hh"
 #include "MultiuserFileSystem.hh"
 #include "XrdChecksum.hh"
+#include "IoUring.hh"
+#include "IdentityWorkerPool.hh"
+#include "Readahead.hh"
+#include "WriteBuffer.hh"
+#include "DirectIO.hh"
+#include "CachePolicy.hh"
+#include "FileCache.hh"
+#include "RateLimiter.hh"
 
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
 
 class MultiuserFile : public XrdOssDF {
 public:
-    MultiuserFile(const char *user, std::unique_ptr<XrdOssDF> ossDF, XrdSysError &log, mode_t umask_mode, bool checksum_on_write, unsigned digests, MultiuserFileSystem *oss);
+    MultiuserFile(const char *user, std::unique_ptr<XrdOssDF> ossDF, XrdSysError &log, mode_t umask_mode,
+                  bool checksum_on_write, unsigned digests, MultiuserFileSystem *oss);
 
     virtual ~MultiuserFile() {
             if (m_state) {delete m_state;}
@@ -32,31 +44,62 @@ public:
 
     void    Flush() override
     {
+        IoPriorityGuard ioprio(m_ioprio, m_log);
+        FlushWrites();
         return m_wrapped->Flush();
     }
 
     int     Fstat(struct stat *buf) override
     {
+        if (int rc = FlushWrites()) {return rc;}
         return m_wrapped->Fstat(buf);
     }
 
     int     Fsync() override
     {
+        IoPriorityGuard ioprio(m_ioprio, m_log);
+        if (int rc = FlushWrites()) {return rc;}
+        if (GroupCommit::IsEnabled()) {return GroupCommit::Sync(*m_wrapped);}
         return m_wrapped->Fsync();
     }
 
     int     Fsync(XrdSfsAio *aiop) override
     {
+        IoPriorityGuard ioprio(m_ioprio, m_log);
+        if (SubmitAio(aiop, false, [this] {return static_cast<ssize_t>(this->Fsync());})) {return 0;}
+        if (GroupCommit::IsEnabled()) {
+            aiop->Result = Fsync();
+            aiop->doneWrite();
+            return 0;
+        }
+        if (int rc = FlushWrites()) {return rc;}
         return m_wrapped->Fsync(aiop);
     }
 
     int     Ftruncate(unsigned long long size) override
     {
+        IoPriorityGuard ioprio(m_ioprio, m_log);
+        if (int rc = FlushWrites()) {return rc;}
         return m_wrapped->Ftruncate(size);
     }
 
+    // Exposing the wrapped descriptor lets the protocol layer serve reads
+    // with sendfile; the descriptor was opened with the user's credentials.
+    int     getFD() override
+    {
+        return ExposeFD() ? m_wrapped->getFD() : -1;
+    }
+
+    // Features which must see every read keep the protocol layer from
+    // bypassing Read() with sendfile.
+    bool    ExposeFD() const
+    {
+        return !m_readahead && !m_write_buffer && !m_direct && !m_cache_policy && m_rate_limits.empty() && !m_ioprio;
+    }
+
     off_t   getMmap(void **addr) override
     {
+        FlushWrites();
         return m_wrapped->getMmap(addr);
     }
 
@@ -68,47 +111,101 @@ public:
     ssize_t pgRead (void* buffer, off_t offset, size_t rdlen,
                         uint32_t* csvec, uint64_t opts) override
     {
-        return m_wrapped->pgRead(buffer, offset, rdlen, csvec, opts);
+        IoPriorityGuard ioprio(m_ioprio, m_log);
+        if (int rc = FlushWrites()) {return rc;}
+        Throttle(rdlen);
+        auto result = m_wrapped->pgRead(buffer, offset, rdlen, csvec, opts);
+        if (result > 0) {ReadDone(offset, result);}
+        return result;
     }
 
     int     pgRead (XrdSfsAio* aioparm, uint64_t opts) override
     {
+        IoPriorityGuard ioprio(m_ioprio, m_log);
+        if (SubmitAio(aioparm, true, [this, aioparm, opts] {
+                return this->pgRead(const_cast<void *>(aioparm->sfsAio.aio_buf), aioparm->sfsAio.aio_offset,
+                                    aioparm->sfsAio.aio_nbytes, aioparm->cksVec, opts);
+            }))
+        {
+            return 0;
+        }
+        if (int rc = FlushWrites()) {return rc;}
+        Throttle(aioparm->sfsAio.aio_nbytes);
         return m_wrapped->pgRead(aioparm, opts);
     }
 
     ssize_t pgWrite(void* buffer, off_t offset, size_t wrlen,
                         uint32_t* csvec, uint64_t opts) override
     {
+        IoPriorityGuard ioprio(m_ioprio, m_log);
+        if (int rc = FlushWrites()) {return rc;}
+        Throttle(wrlen);
         return m_wrapped->pgWrite(buffer, offset, wrlen, csvec, opts);
     }
 
     int     pgWrite(XrdSfsAio* aioparm, uint64_t opts) override
     {
+        IoPriorityGuard ioprio(m_ioprio, m_log);
+        if (SubmitAio(aioparm, false, [this, aioparm, opts] {
+                return this->pgWrite(const_cast<void *>(aioparm->sfsAio.aio_buf), aioparm->sfsAio.aio_offset,
+                                          aioparm->sfsAio.aio_nbytes, aioparm->cksVec, opts);
+            }))
+        {
+            return 0;
+        }
+        if (int rc = FlushWrites()) {return rc;}
+        Throttle(aioparm->sfsAio.aio_nbytes);
         return m_wrapped->pgWrite(aioparm, opts);
     }
 
     ssize_t Read(off_t offset, size_t size) override
     {
+        IoPriorityGuard ioprio(m_ioprio, m_log);
+        if (int rc = FlushWrites()) {return rc;}
         return m_wrapped->Read(offset, size);
     }
 
     ssize_t Read(void *buffer, off_t offset, size_t size) override
     {
-        return m_wrapped->Read(buffer, offset, size);
+        IoPriorityGuard ioprio(m_ioprio, m_log);
+        if (int rc = FlushWrites()) {return rc;}
+        Throttle(size);
+        auto result = m_direct ? m_direct->Read(*m_wrapped, buffer, offset, size) : m_wrapped->Read(buffer, offset, size);
+        if (result > 0) {ReadDone(offset, result);}
+        return result;
     }
 
     int     Read(XrdSfsAio *aiop) override
     {
+        IoPriorityGuard ioprio(m_ioprio, m_log);
+        if (SubmitAio(aiop, true, [this, aiop] {
+                return this->Read(const_cast<void *>(aiop->sfsAio.aio_buf), aiop->sfsAio.aio_offset,
+                                  aiop->sfsAio.aio_nbytes);
+            }))
+        {
+            return 0;
+        }
+        if (int rc = FlushWrites()) {return rc;}
+        Throttle(aiop->sfsAio.aio_nbytes);
         return m_wrapped->Read(aiop);
     }
 
     ssize_t ReadRaw(void *buffer, off_t offset, size_t size) override
     {
+        IoPriorityGuard ioprio(m_ioprio, m_log);
+        if (int rc = FlushWrites()) {return rc;}
+        Throttle(size);
         return m_wrapped->ReadRaw(buffer, offset, size);
     }
 
     ssize_t ReadV(XrdOucIOVec *readV, int rdvcnt) override
     {
+        IoPriorityGuard ioprio(m_ioprio, m_log);
+        if (int rc = FlushWrites()) {return rc;}
+        Throttle(IOVecBytes(readV, rdvcnt));
+        auto ring = (rdvcnt > 1) ? IoUring::ThreadRing() : nullptr;
+        int fd = ring ? m_wrapped->getFD() : -1;
+        if (fd >= 0) {return ring->ReadV(fd, readV, rdvcnt);}
         return m_wrapped->ReadV(readV, rdvcnt);
     }
 
@@ -116,18 +213,105 @@ public:
 
     int     Write(XrdSfsAio *aiop) override
     {
+        IoPriorityGuard ioprio(m_ioprio, m_log);
+        if (SubmitAio(aiop, false, [this, aiop] {
+                return this->Write(const_cast<const void *>(aiop->sfsAio.aio_buf), aiop->sfsAio.aio_offset,
+                                   aiop->sfsAio.aio_nbytes);
+            }))
+        {
+            return 0;
+        }
+        if (int rc = FlushWrites()) {return rc;}
+        Throttle(aiop->sfsAio.aio_nbytes);
         return m_wrapped->Write(aiop);
     }
 
     ssize_t WriteV(XrdOucIOVec *writeV, int wrvcnt) override
     {
+        IoPriorityGuard ioprio(m_ioprio, m_log);
+        if (int rc = FlushWrites()) {return rc;}
+        Throttle(IOVecBytes(writeV, wrvcnt));
+        auto ring = (wrvcnt > 1) ? IoUring::ThreadRing() : nullptr;
+        int fd = ring ? m_wrapped->getFD() : -1;
+        if (fd >= 0) {return ring->WriteV(fd, writeV, wrvcnt);}
         return m_wrapped->WriteV(writeV, wrvcnt);
     }
 
     int Close(long long *retsz=0);
 
+    // Run asynchronous requests on `threads` completion threads holding the
+    // identity each file was opened with (multiuser.aio).  Also used by
+    // group commit, so asynchronous syncs do not hold an Xrootd thread.
+    static void ConfigAio(unsigned threads, XrdSysError &log);
+
+    // Preallocate files opened for writing whose size the client announced
+    // (oss.asize) if it is at least `min_size` bytes; zero, the default,
+    // disables it (multiuser.preallocate).
+    static void ConfigPreallocate(size_t min_size) {m_prealloc_min = min_size;}
+    static size_t GetPreallocateMinimum() {return m_prealloc_min;}
+
 private:
+    void Preallocate(XrdOucEnv &env);
+    bool OpenCached(const char *path, const UserSentry &sentry);
+    void OpenDirect(const char *path, int Oflag, XrdOucEnv &env);
+    long long ExpectedSize(int Oflag, XrdOucEnv &env);
+    void TrimPreallocation();
+
+    // Write out anything held by the write-behind buffer before an operation
+    // which must see it in the file.  Returns 0 or a negative errno.
+    int FlushWrites() {return m_write_buffer ? m_write_buffer->Flush() : 0;}
+
+    // Wait for the opener's rate limits (multiuser.ratelimit) to allow
+    // `bytes` of I/O.
+    void Throttle(size_t bytes) {RateLimiter::Throttle(m_rate_limits, bytes);}
+
+    static size_t IOVecBytes(const XrdOucIOVec *vec, int count)
+    {
+        size_t bytes = 0;
+        for (int idx = 0; idx < count; idx++) {bytes += vec[idx].size;}
+        return bytes;
+    }
+
+    // Let readahead and the cache policy act on a completed read.
+    void ReadDone(off_t offset, size_t size)
+    {
+        if (m_readahead) {m_readahead->OnRead(m_wrapped->getFD(), offset, size);}
+        if (m_cache_policy) {m_cache_policy->OnRead(offset, size);}
+    }
+
+    // Queue an asynchronous request for an aio completion thread, which runs
+    // op(), stores its result in aiop->Result and calls doneRead/doneWrite.
+    // A file's requests run one at a time in the order they were submitted,
+    // so a sync never overtakes earlier writes and the readahead and
+    // write-behind state is never used concurrently.  Returns false if the
+    // request must be handled inline instead.
+    bool SubmitAio(XrdSfsAio *aiop, bool is_read, std::function<ssize_t()> op);
+
+    // Run the file's queued aio requests until none are left.
+    void RunAio(bool ok);
+
+    struct AioRequest {
+        XrdSfsAio *m_aiop;
+        bool m_is_read;
+        std::function<ssize_t()> m_op;
+    };
+
+    static IdentityWorkerPool *m_aio_pool;
+    static size_t m_prealloc_min;
+    UserSentry::Resolution m_resolution;
+    // The request at the front is running on a completion thread.
+    std::mutex m_aio_mutex;
+    std::deque<AioRequest> m_aio_queue;
+    std::unique_ptr<Readahead> m_readahead;
+    std::unique_ptr<DirectIO> m_direct;
+    std::unique_ptr<CachePolicy> m_cache_policy;
+    RateLimiter::Buckets m_rate_limits;
+    // The opener's I/O priority (multiuser.ioclass); 0 if none.
+    int m_ioprio{0};
+
     std::unique_ptr<XrdOssDF> m_wrapped;
+    // Writes into m_wrapped, so must go first.
+    std::unique_ptr<WriteBuffer> m_write_buffer;
     XrdSysError &m_log;
     const XrdSecEntity* m_client;
     mode_t m_umask_mode;
@@ -137,6 +321,7 @@ private:
     MultiuserFileSystem *m_oss;
     bool m_checksum_on_write;
     unsigned m_digests;
+    off_t m_preallocated;
 
 };
 
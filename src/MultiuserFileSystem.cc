@@ -15,8 +15,16 @@
 #include "MultiuserFileSystem.hh"
 #include "MultiuserDirectory.hh"
 #include "UserSentry.hh"
+#include "IdentityCache.hh"
+#include "IdMap.hh"
+#include "SessionIdentity.hh"
+#include "IdentityWorkerPool.hh"
+#include "IoUring.hh"
+#include "DirectoryReader.hh"
 #include "MultiuserFile.hh"
 
+#include <algorithm>
+#include <cctype>
 #include <exception>
 #include <limits>
 #include <memory>
@@ -36,6 +44,32 @@
 #include <unistd.h>
 
 
+/*
+ * Parse a positive size in bytes, optionally suffixed with k, m or g.
+ */
+static bool
+parse_size(XrdSysError &log, const char *directive, const char *what, const char *val, size_t &out)
+{
+    char *endptr = NULL;
+    errno = 0;
+    long long num = val ? strtoll(val, &endptr, 10) : -1;
+    int shift = 0;
+    if (endptr && *endptr) {
+        switch (tolower(*endptr)) {
+            case 'k': shift = 10; break;
+            case 'm': shift = 20; break;
+            case 'g': shift = 30; break;
+            default: shift = -1;
+        }
+        if (endptr[1]) {shift = -1;}
+    }
+    if (!val || !val[0] || errno || (shift < 0) || (num < 1) || (num > (1LL << 40) >> shift)) {
+        log.Emsg("Config", directive, what, "must be a positive size, optionally suffixed with k, m or g");
+        return false;
+    }
+    out = static_cast<size_t>(num) << shift;
+    return true;
+}
 
 MultiuserFileSystem::MultiuserFileSystem(XrdOss *oss, XrdSysLogger *lp, const char *configfn, XrdOucEnv *envP) :
     m_umask_mode(-1),
@@ -70,6 +104,13 @@ MultiuserFileSystem::Config(XrdSysLogger *lp, const char *configfn)
     }
     Config.Attach(cfgFD);
     const char *val;
+    unsigned pool_threads = 0, pool_max_per_user = 0;
+    unsigned iouring_depth = 0;
+    unsigned aio_threads = 0;
+    unsigned groupcommit_window = 0;
+    GroupCommit::Mode groupcommit_mode = GroupCommit::Fsync;
+    bool warmup_all = false;
+    std::vector<std::string> warmup_users;
 
     // Parse a single non-negative integer argument for the given directive.
     // On success stores the value in `out` and returns true; on any error it
@@ -96,6 +137,27 @@ MultiuserFileSystem::Config(XrdSysLogger *lp, const char *configfn)
     };
 
     while ((val = Config.GetMyFirstWord())) {
+        // Note other OSS plugins; features which bypass the wrapped OSS are
+        // only safe when it is the default one.
+        if (!strcmp("ofs.osslib", val)) {
+            val = Config.GetWord();
+            if (val && !strcmp("++", val)) {val = Config.GetWord();}
+            if (val && !strstr(val, "XrdMultiuser")) {m_stacked_oss = val;}
+            continue;
+        }
+        // Likewise for file system plugins in front of the default XrdOfs
+        // (e.g., xrootd.fslib throttle default).
+        if (!strcmp("xrootd.fslib", val)) {
+            while ((val = Config.GetWord())) {
+                if (!strcmp("++", val) || !strcmp("-2", val) || !strcmp("default", val) || strstr(val, "XrdOfs")) {
+                    continue;
+                }
+                m_stacked_sfs = val;
+                break;
+            }
+            continue;
+        }
+
         if (!strcmp("multiuser.umask", val)) {
             val = Config.GetWord();
             if (!val || !val[0]) {
@@ -149,6 +211,232 @@ MultiuserFileSystem::Config(XrdSysLogger *lp, const char *configfn)
             UserSentry::SetMinimumGid(static_cast<gid_t>(min_gid));
         }
 
+        // Username -> identity cache used by UserSentry.
+        if (!strcmp("multiuser.idcache", val)) {
+            if (!ConfigIdCache(Config)) {
+                Config.Close();
+                return false;
+            }
+        }
+
+        // Local binary identity map consulted before (or instead of) NSS.
+        if (!strcmp("multiuser.idmap", val)) {
+            val = Config.GetWord();
+            if (!val || !val[0]) {
+                m_log.Emsg("Config", "multiuser.idmap must specify a file name");
+                Config.Close();
+                return false;
+            }
+            std::string idmap_file(val);
+            bool exclusive = false;
+            if ((val = Config.GetWord())) {
+                if (strcmp("exclusive", val)) {
+                    m_log.Emsg("Config", "multiuser.idmap encountered an unknown option:", val);
+                    Config.Close();
+                    return false;
+                }
+                exclusive = true;
+            }
+            if (!IdMap::Instance().Configure(idmap_file, exclusive, m_log)) {
+                Config.Close();
+                return false;
+            }
+        }
+
+        // Supplementary group trimming.
+        if (!strcmp("multiuser.groups", val)) {
+            if (!ConfigGroups(Config)) {
+                Config.Close();
+                return false;
+            }
+        }
+
+        // Accounts whose identities are resolved at startup and kept fresh.
+        if (!strcmp("multiuser.idwarmup", val)) {
+            val = Config.GetWord();
+            if (!val || !val[0]) {
+                m_log.Emsg("Config", "multiuser.idwarmup must specify 'all' or a list of usernames");
+                Config.Close();
+                return false;
+            }
+            do {
+                if (!strcmp("all", val)) {
+                    warmup_all = true;
+                } else {
+                    warmup_users.emplace_back(val);
+                }
+            } while ((val = Config.GetWord()));
+        }
+
+        // Run filesystem operations on identity-pinned worker threads.
+        if (!strcmp("multiuser.workerpool", val)) {
+            if (!ConfigWorkerPool(Config, pool_threads, pool_max_per_user)) {
+                Config.Close();
+                return false;
+            }
+        }
+
+        // Keep the last user's identity on the thread between operations.
+        if (!strcmp("multiuser.stickyidentity", val)) {
+            val = Config.GetWord();
+            if (!val || !val[0]) {
+                m_log.Emsg("Config", "multiuser.stickyidentity must specify a value, on or off");
+                Config.Close();
+                return false;
+            }
+            if (!strcmp("on", val)) {
+                UserSentry::SetSticky(true);
+            }
+            else if (!strcmp("off", val)) {
+                UserSentry::SetSticky(false);
+            }
+            else {
+                std::string errorMsg = "multiuser.stickyidentity must be either on or off, not: ";
+                errorMsg += val;
+                m_log.Emsg("Config", errorMsg.c_str());
+                Config.Close();
+                return false;
+            }
+        }
+
+        // Readahead for sequential readers.
+        if (!strcmp("multiuser.readahead", val)) {
+            if (!ConfigReadahead(Config)) {
+                Config.Close();
+                return false;
+            }
+        }
+
+        // Write-behind buffering of small writes.
+        if (!strcmp("multiuser.writebuffer", val)) {
+            if (!ConfigWriteBuffer(Config)) {
+                Config.Close();
+                return false;
+            }
+        }
+
+        // Preallocation of uploads with a size hint.
+        if (!strcmp("multiuser.preallocate", val)) {
+            val = Config.GetWord();
+            size_t min_size = 0;
+            if (val && !strcmp("on", val)) {
+                min_size = 16 * 1024 * 1024;
+            } else if (!val || strcmp("off", val)) {
+                if (!parse_size(m_log, "multiuser.preallocate", "minimum", val, min_size)) {
+                    Config.Close();
+                    return false;
+                }
+            }
+            MultiuserFile::ConfigPreallocate(min_size);
+        }
+
+        // O_DIRECT for large transfers.
+        if (!strcmp("multiuser.directio", val)) {
+            if (!ConfigDirectIO(Config)) {
+                Config.Close();
+                return false;
+            }
+        }
+
+        // Page cache management for large transfers and checksum scans.
+        if (!strcmp("multiuser.cachepolicy", val)) {
+            val = Config.GetWord();
+            if (!val || !val[0] || (strcmp("on", val) && strcmp("off", val))) {
+                m_log.Emsg("Config", "multiuser.cachepolicy must be either on or off, optionally followed by minsize <size>");
+                Config.Close();
+                return false;
+            }
+            bool enabled = !strcmp("on", val);
+            size_t min_size = CachePolicy::GetMinimumSize();
+            if ((val = Config.GetWord())) {
+                if (strcmp("minsize", val)) {
+                    m_log.Emsg("Config", "multiuser.cachepolicy encountered an unknown option:", val);
+                    Config.Close();
+                    return false;
+                }
+                if (!parse_size(m_log, "multiuser.cachepolicy", "minsize", Config.GetWord(), min_size)) {
+                    Config.Close();
+                    return false;
+                }
+            }
+            CachePolicy::Configure(enabled, min_size);
+        }
+
+        // Cache of read-only descriptors of hot small files.
+        if (!strcmp("multiuser.filecache", val)) {
+            if (!ConfigFileCache(Config)) {
+                Config.Close();
+                return false;
+            }
+        }
+
+        // Completion threads for asynchronous I/O.
+        if (!strcmp("multiuser.aio", val)) {
+            val = Config.GetWord();
+            char *endptr = NULL;
+            errno = 0;
+            long int num = (val && strcmp("off", val)) ? strtol(val, &endptr, 10) : 0;
+            if (!val || !val[0] || errno || (endptr && *endptr != '\0') || (num < 0) || (num > 4096)) {
+                m_log.Emsg("Config", "multiuser.aio must be off or a number of threads between 0 and 4096");
+                Config.Close();
+                return false;
+            }
+            aio_threads = num;
+        }
+
+        // Block-layer I/O priorities per user or group.
+        if (!strcmp("multiuser.ioclass", val)) {
+            if (!ConfigIoClass(Config)) {
+                Config.Close();
+                return false;
+            }
+        }
+
+        // Per-user and per-group bandwidth limits.
+        if (!strcmp("multiuser.ratelimit", val)) {
+            if (!ConfigRateLimit(Config)) {
+                Config.Close();
+                return false;
+            }
+        }
+
+        // Batched Fsync on a durability thread.
+        if (!strcmp("multiuser.groupcommit", val)) {
+            if (!ConfigGroupCommit(Config, groupcommit_window, groupcommit_mode)) {
+                Config.Close();
+                return false;
+            }
+        }
+
+        // Batched directory listings with attributes.
+        if (!strcmp("multiuser.readdirplus", val)) {
+            val = Config.GetWord();
+            if (!val || !val[0] || (strcmp("on", val) && strcmp("off", val))) {
+                m_log.Emsg("Config", "multiuser.readdirplus must be either on or off, optionally followed by dontsync");
+                Config.Close();
+                return false;
+            }
+            bool enabled = !strcmp("on", val);
+            bool dont_sync = false;
+            while ((val = Config.GetWord())) {
+                if (strcmp("dontsync", val)) {
+                    m_log.Emsg("Config", "multiuser.readdirplus encountered an unknown option:", val);
+                    Config.Close();
+                    return false;
+                }
+                dont_sync = true;
+            }
+            DirectoryReader::Configure(enabled, dont_sync);
+        }
+
+        // Batch vector I/O through io_uring.
+        if (!strcmp("multiuser.iouring", val)) {
+            if (!ConfigIoUring(Config, iouring_depth)) {
+                Config.Close();
+                return false;
+            }
+        }
+
         // Checksum on write
         if (!strcmp("multiuser.checksumonwrite", val)) {
             val = Config.GetWord();
@@ -223,16 +511,698 @@ MultiuserFileSystem::Config(XrdSysLogger *lp, const char *configfn)
         m_log.Emsg("Config", ss.str().c_str());
     }
 
+    // A held identity outlives the plugin's own calls; any other plugin on
+    // the thread would touch the storage as the last user served.
+    if (UserSentry::IsSticky() && (!m_stacked_oss.empty() || !m_stacked_sfs.empty())) {
+        m_log.Emsg("Config", "Ignoring multiuser.stickyidentity: another storage plugin is loaded:",
+            m_stacked_oss.empty() ? m_stacked_sfs.c_str() : m_stacked_oss.c_str());
+        UserSentry::SetSticky(false);
+    }
+
+    if (UserSentry::IsSticky()) {
+        m_log.Emsg("Config", "Threads will keep the last user's filesystem identity between operations");
+    }
+
+    if (Readahead::IsEnabled()) {
+        std::stringstream ss;
+        ss << "Reading ahead up to " << (Readahead::GetMaxWindow() >> 20) << " MiB per sequentially-read file ("
+           << (Readahead::GetBudget() >> 20) << " MiB in total); sendfile is disabled";
+        m_log.Emsg("Config", ss.str().c_str());
+    }
+
+    if (MultiuserFile::GetPreallocateMinimum()) {
+        std::stringstream ss;
+        ss << "Preallocating uploads of at least " << (MultiuserFile::GetPreallocateMinimum() >> 10)
+           << " KiB announced by the client";
+        m_log.Emsg("Config", ss.str().c_str());
+    }
+
+    if (WriteBuffer::IsEnabled()) {
+        std::stringstream ss;
+        ss << "Coalescing small writes in " << (WriteBuffer::GetSize() >> 10) << " KiB buffers per file ("
+           << (WriteBuffer::GetBudget() >> 20) << " MiB in total); sendfile is disabled for files open for writing";
+        m_log.Emsg("Config", ss.str().c_str());
+    }
+
+    if (IoClass::Instance().IsEnabled()) {
+        auto &ioclass = IoClass::Instance();
+        std::stringstream ss;
+        ss << "Setting the I/O priority of " << ioclass.GetUserCount() << " user(s) and "
+           << ioclass.GetGroupCount() << " group(s) while serving their requests";
+        m_log.Emsg("Config", ss.str().c_str());
+    }
+
+    if (RateLimiter::Instance().IsEnabled()) {
+        auto &rate_limiter = RateLimiter::Instance();
+        // A later multiuser.ratelimit line may have changed the burst after
+        // some group buckets were created.
+        rate_limiter.ApplyBurst();
+        std::stringstream ss;
+        ss << "Limiting file I/O to ";
+        if (rate_limiter.GetUserRate()) {ss << (rate_limiter.GetUserRate() >> 10) << " KiB/s per user";}
+        else {ss << "no per-user limit";}
+        ss << " and " << rate_limiter.GetGroupCount() << " group limit(s), with bursts of "
+           << rate_limiter.GetBurst() << "ms; sendfile is disabled";
+        m_log.Emsg("Config", ss.str().c_str());
+    }
+
+    // A cache hit never reaches the wrapped OSS's Open.
+    if (FileCache::Instance().IsEnabled() && !m_stacked_oss.empty()) {
+        m_log.Emsg("Config", "Ignoring multiuser.filecache: the wrapped OSS is not the default one but",
+            m_stacked_oss.c_str());
+        FileCache::Instance().Disable();
+    }
+
+    if (FileCache::Instance().IsEnabled()) {
+        auto &file_cache = FileCache::Instance();
+        std::stringstream ss;
+        ss << "Caching up to " << file_cache.GetMaxFds() << " read-only descriptors of files up to "
+           << (file_cache.GetMaxSize() >> 10) << " KiB per user, revalidated after "
+           << file_cache.GetRevalidate() << "s";
+        m_log.Emsg("Config", ss.str().c_str());
+    }
+
+    if (CachePolicy::IsEnabled()) {
+        std::stringstream ss;
+        ss << "Dropping large transfers and checksum scans of files of at least "
+           << (CachePolicy::GetMinimumSize() >> 20) << " MiB from the page cache behind the cursor";
+        m_log.Emsg("Config", ss.str().c_str());
+    }
+
+    // The O_DIRECT descriptor goes around the wrapped OSS.
+    if (DirectIO::IsEnabled() && !m_stacked_oss.empty()) {
+        m_log.Emsg("Config", "Ignoring multiuser.directio: the wrapped OSS is not the default one but",
+            m_stacked_oss.c_str());
+        DirectIO::Configure(false, 0, std::vector<std::string>());
+    }
+
+    if (DirectIO::IsEnabled()) {
+        std::stringstream ss;
+        ss << "Using direct I/O for files of at least " << (DirectIO::GetMinimumSize() >> 20) << " MiB";
+        if (!DirectIO::GetPrefixes().empty()) {
+            ss << " below";
+            for (const auto &prefix : DirectIO::GetPrefixes()) {ss << " " << prefix;}
+        }
+        m_log.Emsg("Config", ss.str().c_str());
+    }
+
+    // Listing the physical directory skips the wrapped OSS's Readdir.
+    if (DirectoryReader::IsEnabled() && !m_stacked_oss.empty()) {
+        m_log.Emsg("Config", "Ignoring multiuser.readdirplus: the wrapped OSS is not the default one but",
+            m_stacked_oss.c_str());
+        DirectoryReader::Configure(false, false);
+    }
+
+    if (DirectoryReader::IsEnabled()) {
+        m_log.Emsg("Config", "Directory listings with attributes will be read in batches",
+            DirectoryReader::IsDontSync() ? "(without forcing attribute synchronization)" : "");
+    }
+
+    if (IdentityCache::Instance().HasGroupPolicy()) {
+        m_log.Emsg("Config", "Supplementary groups of mapped users will be trimmed per multiuser.groups");
+    }
+
+    {
+        auto &cache = IdentityCache::Instance();
+        std::stringstream ss;
+        ss << "Caching up to " << cache.GetMaxEntries() << " user identities for "
+           << cache.GetPositiveTTL() << "s (failed lookups for " << cache.GetNegativeTTL() << "s)";
+        m_log.Emsg("Config", ss.str().c_str());
+    }
+
+    // The ring works on the wrapped descriptor, around the wrapped OSS's
+    // ReadV / WriteV.
+    if (iouring_depth && !m_stacked_oss.empty()) {
+        m_log.Emsg("Config", "Ignoring multiuser.iouring: the wrapped OSS is not the default one but",
+            m_stacked_oss.c_str());
+        iouring_depth = 0;
+    }
+    if (iouring_depth) {
+        IoUring::Configure(iouring_depth, m_log);
+    }
+
+    // An asynchronous sync must not hold an Xrootd thread for a whole batch
+    // window.
+    if (groupcommit_window && !aio_threads) {
+        m_log.Emsg("Config", "multiuser.groupcommit completes asynchronous syncs on 16 completion threads; "
+            "set multiuser.aio to change their number");
+        aio_threads = 16;
+    }
+    if (aio_threads) {
+        MultiuserFile::ConfigAio(aio_threads, m_log);
+    }
+
+    if (groupcommit_window) {
+        GroupCommit::Configure(groupcommit_window, groupcommit_mode);
+        std::stringstream ss;
+        ss << "Batching Fsync requests arriving within " << groupcommit_window << "us using "
+           << ((groupcommit_mode == GroupCommit::Syncfs) ? "syncfs" : "fsync");
+        m_log.Emsg("Config", ss.str().c_str());
+    }
+
+    if (pool_threads) {
+        IdentityWorkerPool::Configure(pool_threads, pool_max_per_user, m_log);
+    }
+
+    if (warmup_all) {
+        auto accounts = IdentityCache::EnumerateAccounts();
+        warmup_users.insert(warmup_users.end(), accounts.begin(), accounts.end());
+    }
+    if (!warmup_users.empty()) {
+        std::sort(warmup_users.begin(), warmup_users.end());
+        warmup_users.erase(std::unique(warmup_users.begin(), warmup_users.end()), warmup_users.end());
+        IdentityCache::Instance().Warm(warmup_users, m_log);
+    }
+
     return true;
 
 }
+
+/*
+ * Parse the arguments of the multiuser.readahead directive:
+ *
+ *   multiuser.readahead on|off [window <MiB>] [budget <MiB>]
+ */
+bool
+MultiuserFileSystem::ConfigReadahead(XrdOucStream &Config)
+{
+    const char *val = Config.GetWord();
+    if (!val || !val[0] || (strcmp("on", val) && strcmp("off", val))) {
+        m_log.Emsg("Config", "multiuser.readahead must be either on or off");
+        return false;
+    }
+    if (!strcmp("off", val)) {
+        Readahead::Configure(0, 0);
+        return true;
+    }
+    size_t window = 64, budget = 1024;
+    while ((val = Config.GetWord())) {
+        std::string option(val);
+        if ((option != "window") && (option != "budget")) {
+            m_log.Emsg("Config", "multiuser.readahead encountered an unknown option:", val);
+            return false;
+        }
+        val = Config.GetWord();
+        if (!val || !val[0]) {
+            m_log.Emsg("Config", "multiuser.readahead option", option.c_str(), "must specify a value");
+            return false;
+        }
+        char *endptr = NULL;
+        errno = 0;
+        long int num = strtol(val, &endptr, 10);
+        if (errno || (endptr && *endptr != '\0') || (num < 1) || (num > 1024 * 1024)) {
+            m_log.Emsg("Config", "multiuser.readahead option", option.c_str(), "must specify a positive number of MiB");
+            return false;
+        }
+        if (option == "window") {window = num;}
+        else {budget = num;}
+    }
+    Readahead::Configure(window << 20, budget << 20);
+    return true;
+}
+
+/*
+ * Parse the arguments of the multiuser.writebuffer directive:
+ *
+ *   multiuser.writebuffer <size>|off [total <size>]
+ *
+ * Sizes are in bytes, optionally suffixed with k, m or g.
+ */
+bool
+MultiuserFileSystem::ConfigWriteBuffer(XrdOucStream &Config)
+{
+    const char *val = Config.GetWord();
+    if (val && !strcmp("off", val)) {
+        WriteBuffer::Configure(0, 0);
+        return true;
+    }
+    size_t size, total = 1 << 30;
+    if (!parse_size(m_log, "multiuser.writebuffer", "size", val, size)) {return false;}
+    while ((val = Config.GetWord())) {
+        if (strcmp("total", val)) {
+            m_log.Emsg("Config", "multiuser.writebuffer encountered an unknown option:", val);
+            return false;
+        }
+        if (!parse_size(m_log, "multiuser.writebuffer", "total", Config.GetWord(), total)) {return false;}
+    }
+    if ((size < 4096) || (size > total)) {
+        m_log.Emsg("Config", "multiuser.writebuffer size must be at least 4k and no more than the total");
+        return false;
+    }
+    WriteBuffer::Configure(size, total);
+    return true;
+}
+
+/*
+ * Parse the arguments of the multiuser.filecache directive:
+ *
+ *   multiuser.filecache <maxfds>|off [maxsize <size>] [revalidate <sec>]
+ */
+bool
+MultiuserFileSystem::ConfigFileCache(XrdOucStream &Config)
+{
+    auto parse_number = [&](const char *what, const char *val, long long max, long long &out) -> bool {
+        char *endptr = NULL;
+        errno = 0;
+        long long num = val ? strtoll(val, &endptr, 10) : -1;
+        if (!val || !val[0] || errno || (endptr && *endptr != '\0') || (num < 0) || (num > max)) {
+            m_log.Emsg("Config", "multiuser.filecache", what, "must be a non-negative integer");
+            return false;
+        }
+        out = num;
+        return true;
+    };
+
+    const char *val = Config.GetWord();
+    auto &file_cache = FileCache::Instance();
+    if (val && !strcmp("off", val)) {
+        file_cache.Disable();
+        return true;
+    }
+    long long max_fds, revalidate = file_cache.GetRevalidate();
+    size_t max_size = file_cache.GetMaxSize();
+    if (!parse_number("maxfds", val, 1 << 20, max_fds)) {return false;}
+    while ((val = Config.GetWord())) {
+        if (!strcmp("maxsize", val)) {
+            if (!parse_size(m_log, "multiuser.filecache", "maxsize", Config.GetWord(), max_size)) {return false;}
+        } else if (!strcmp("revalidate", val)) {
+            if (!parse_number("revalidate", Config.GetWord(), 86400, revalidate)) {return false;}
+        } else {
+            m_log.Emsg("Config", "multiuser.filecache encountered an unknown option:", val);
+            return false;
+        }
+    }
+    file_cache.Configure(max_fds, max_size, revalidate);
+    return true;
+}
+
+/*
+ * Parse the arguments of the multiuser.directio directive:
+ *
+ *   multiuser.directio on|off [minsize <size>] [prefix <path>] [...]
+ */
+bool
+MultiuserFileSystem::ConfigDirectIO(XrdOucStream &Config)
+{
+    const char *val = Config.GetWord();
+    if (!val || !val[0] || (strcmp("on", val) && strcmp("off", val))) {
+        m_log.Emsg("Config", "multiuser.directio must be either on or off");
+        return false;
+    }
+    if (!strcmp("off", val)) {
+        DirectIO::Configure(false, 0, {});
+        return true;
+    }
+    size_t min_size = 1 << 30;
+    std::vector<std::string> prefixes;
+    while ((val = Config.GetWord())) {
+        if (!strcmp("minsize", val)) {
+            if (!parse_size(m_log, "multiuser.directio", "minsize", Config.GetWord(), min_size)) {return false;}
+        } else if (!strcmp("prefix", val)) {
+            val = Config.GetWord();
+            if (!val || (val[0] != '/')) {
+                m_log.Emsg("Config", "multiuser.directio prefix must specify an absolute path");
+                return false;
+            }
+            prefixes.emplace_back(val);
+        } else {
+            m_log.Emsg("Config", "multiuser.directio encountered an unknown option:", val);
+            return false;
+        }
+    }
+    DirectIO::Configure(true, min_size, prefixes);
+    return true;
+}
+
+/*
+ * Parse the arguments of the multiuser.ioclass directive:
+ *
+ *   multiuser.ioclass user <username> <class> [<level>]
+ *   multiuser.ioclass group <gid> <class> [<level>]
+ *
+ * The class is realtime (rt), best-effort (be) or idle; the level (0, the
+ * highest, to 7) is required except for idle.
+ */
+bool
+MultiuserFileSystem::ConfigIoClass(XrdOucStream &Config)
+{
+    const char *val = Config.GetWord();
+    if (!val || (strcmp("user", val) && strcmp("group", val))) {
+        m_log.Emsg("Config", "multiuser.ioclass must be followed by user <username> or group <gid>");
+        return false;
+    }
+    bool is_user = !strcmp("user", val);
+    val = Config.GetWord();
+    if (!val || !val[0]) {
+        m_log.Emsg("Config", "multiuser.ioclass must specify a username or GID");
+        return false;
+    }
+    std::string name(val);
+    long long gid = 0;
+    if (!is_user) {
+        char *endptr = NULL;
+        errno = 0;
+        gid = strtoll(val, &endptr, 10);
+        if (errno || (endptr && *endptr != '\0') || (gid < 0) ||
+            (gid > static_cast<long long>(std::numeric_limits<gid_t>::max())))
+        {
+            m_log.Emsg("Config", "multiuser.ioclass group must be a numeric GID:", val);
+            return false;
+        }
+    }
+
+    IoClass::Class ioclass;
+    val = Config.GetWord();
+    if (!val || !IoClass::ParseClass(val, ioclass)) {
+        m_log.Emsg("Config", "multiuser.ioclass class must be one of realtime, best-effort or idle");
+        return false;
+    }
+    long int level = 0;
+    if (ioclass != IoClass::Idle) {
+        val = Config.GetWord();
+        char *endptr = NULL;
+        errno = 0;
+        level = val ? strtol(val, &endptr, 10) : -1;
+        if (!val || !val[0] || errno || (endptr && *endptr != '\0') || (level < 0) || (level > 7)) {
+            m_log.Emsg("Config", "multiuser.ioclass level must be a number between 0 and 7");
+            return false;
+        }
+    }
+
+    int ioprio = IoClass::Encode(ioclass, level);
+    if (is_user) {IoClass::Instance().SetUser(name, ioprio);}
+    else {IoClass::Instance().SetGroup(gid, ioprio);}
+    return true;
+}
+
+/*
+ * Parse the arguments of the multiuser.ratelimit directive:
+ *
+ *   multiuser.ratelimit [user <rate>] [group <gid> <rate>] [...] [burst <msec>] | off
+ *
+ * Rates are in bytes per second, optionally suffixed with k, m or g.
+ */
+bool
+MultiuserFileSystem::ConfigRateLimit(XrdOucStream &Config)
+{
+    auto &rate_limiter = RateLimiter::Instance();
+    const char *val = Config.GetWord();
+    if (!val || !val[0]) {
+        m_log.Emsg("Config", "multiuser.ratelimit must specify at least one option");
+        return false;
+    }
+    if (!strcmp("off", val)) {
+        rate_limiter.Clear();
+        return true;
+    }
+    size_t user_rate = 0;
+    std::vector<std::pair<gid_t, size_t>> group_rates;
+    unsigned burst = rate_limiter.GetBurst();
+    do {
+        std::string option(val);
+        if (option == "user") {
+            if (!parse_size(m_log, "multiuser.ratelimit", "user", Config.GetWord(), user_rate)) {return false;}
+        } else if (option == "group") {
+            val = Config.GetWord();
+            char *endptr = NULL;
+            errno = 0;
+            long long gid = val ? strtoll(val, &endptr, 10) : -1;
+            if (!val || !val[0] || errno || (endptr && *endptr != '\0') || (gid < 0) ||
+                (gid > static_cast<long long>(std::numeric_limits<gid_t>::max())))
+            {
+                m_log.Emsg("Config", "multiuser.ratelimit group must specify a GID and a rate");
+                return false;
+            }
+            size_t rate;
+            if (!parse_size(m_log, "multiuser.ratelimit", "group", Config.GetWord(), rate)) {return false;}
+            group_rates.emplace_back(gid, rate);
+        } else if (option == "burst") {
+            val = Config.GetWord();
+            char *endptr = NULL;
+            errno = 0;
+            long int num = val ? strtol(val, &endptr, 10) : -1;
+            if (!val || !val[0] || errno || (endptr && *endptr != '\0') || (num < 0) || (num > 60000)) {
+                m_log.Emsg("Config", "multiuser.ratelimit burst must be a number of milliseconds between 0 and 60000");
+                return false;
+            }
+            burst = num;
+        } else {
+            m_log.Emsg("Config", "multiuser.ratelimit encountered an unknown option:", val);
+            return false;
+        }
+    } while ((val = Config.GetWord()));
+
+    // Configure applies the final burst to every bucket.
+    rate_limiter.SetBurst(burst);
+    rate_limiter.SetUserRate(user_rate);
+    for (const auto &group : group_rates) {rate_limiter.SetGroupRate(group.first, group.second);}
+    return true;
+}
+
+/*
+ * Parse the arguments of the multiuser.groupcommit directive:
+ *
+ *   multiuser.groupcommit on|off [window <usec>] [syncfs]
+ */
+bool
+MultiuserFileSystem::ConfigGroupCommit(XrdOucStream &Config, unsigned &window, GroupCommit::Mode &mode)
+{
+    const char *val = Config.GetWord();
+    if (!val || !val[0] || (strcmp("on", val) && strcmp("off", val))) {
+        m_log.Emsg("Config", "multiuser.groupcommit must be either on or off");
+        return false;
+    }
+    if (!strcmp("off", val)) {
+        window = 0;
+        return true;
+    }
+    window = 1000;
+    mode = GroupCommit::Fsync;
+    while ((val = Config.GetWord())) {
+        if (!strcmp("syncfs", val)) {
+            mode = GroupCommit::Syncfs;
+        } else if (!strcmp("window", val)) {
+            val = Config.GetWord();
+            char *endptr = NULL;
+            errno = 0;
+            long int num = val ? strtol(val, &endptr, 10) : 0;
+            if (!val || !val[0] || errno || (endptr && *endptr != '\0') || (num < 1) || (num > 1000000)) {
+                m_log.Emsg("Config", "multiuser.groupcommit window must be a number of microseconds between 1 and 1000000");
+                return false;
+            }
+            window = num;
+        } else {
+            m_log.Emsg("Config", "multiuser.groupcommit encountered an unknown option:", val);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Parse the arguments of the multiuser.iouring directive:
+ *
+ *   multiuser.iouring on|off [depth <n>]
+ */
+bool
+MultiuserFileSystem::ConfigIoUring(XrdOucStream &Config, unsigned &depth)
+{
+    const char *val = Config.GetWord();
+    if (!val || !val[0]) {
+        m_log.Emsg("Config", "multiuser.iouring must specify a value, on or off");
+        return false;
+    }
+    if (!strcmp("off", val)) {
+        depth = 0;
+        return true;
+    }
+    if (strcmp("on", val)) {
+        m_log.Emsg("Config", "multiuser.iouring must be either on or off, not:", val);
+        return false;
+    }
+    depth = 64;
+    while ((val = Config.GetWord())) {
+        if (strcmp("depth", val)) {
+            m_log.Emsg("Config", "multiuser.iouring encountered an unknown option:", val);
+            return false;
+        }
+        val = Config.GetWord();
+        if (!val || !val[0]) {
+            m_log.Emsg("Config", "multiuser.iouring depth must specify a value");
+            return false;
+        }
+        char *endptr = NULL;
+        errno = 0;
+        long int num = strtol(val, &endptr, 10);
+        if (errno || (endptr && *endptr != '\0') || (num < 1) || (num > 4096)) {
+            m_log.Emsg("Config", "multiuser.iouring depth must be an integer between 1 and 4096");
+            return false;
+        }
+        depth = num;
+    }
+    return true;
+}
+
+/*
+ * Parse the arguments of the multiuser.workerpool directive:
+ *
+ *   multiuser.workerpool <threads> [maxperuser <n>]
+ */
+bool
+MultiuserFileSystem::ConfigWorkerPool(XrdOucStream &Config, unsigned &threads, unsigned &max_per_user)
+{
+    auto parse_count = [&](const char *option, const char *val, unsigned &out) -> bool {
+        if (!val || !val[0]) {
+            m_log.Emsg("Config", "multiuser.workerpool", option, "must specify a value");
+            return false;
+        }
+        char *endptr = NULL;
+        errno = 0;
+        long int num = strtol(val, &endptr, 10);
+        if (errno || (endptr && *endptr != '\0') || (num < 0) || (num > 4096)) {
+            m_log.Emsg("Config", "multiuser.workerpool", option, "must be an integer between 0 and 4096");
+            return false;
+        }
+        out = num;
+        return true;
+    };
+
+    if (!parse_count("thread count", Config.GetWord(), threads)) {return false;}
+    const char *val;
+    while ((val = Config.GetWord())) {
+        if (strcmp("maxperuser", val)) {
+            m_log.Emsg("Config", "multiuser.workerpool encountered an unknown option:", val);
+            return false;
+        }
+        if (!parse_count("maxperuser", Config.GetWord(), max_per_user)) {return false;}
+    }
+    return true;
+}
+
+/*
+ * Parse the arguments of the multiuser.groups directive:
+ *
+ *   multiuser.groups allow <gid>[-<gid>][,...] [...]
+ *   multiuser.groups maxcount <n>
+ */
+bool
+MultiuserFileSystem::ConfigGroups(XrdOucStream &Config)
+{
+    auto &cache = IdentityCache::Instance();
+    auto parse_gid = [&](const std::string &str, gid_t &gid) -> bool {
+        char *endptr = NULL;
+        errno = 0;
+        unsigned long val = strtoul(str.c_str(), &endptr, 10);
+        if (str.empty() || str[0] == '-' || errno || (endptr && *endptr != '\0') ||
+            (val > std::numeric_limits<gid_t>::max()))
+        {
+            m_log.Emsg("Config", "multiuser.groups encountered an invalid group ID:", str.c_str());
+            return false;
+        }
+        gid = val;
+        return true;
+    };
+
+    const char *val = Config.GetWord();
+    if (!val || !val[0]) {
+        m_log.Emsg("Config", "multiuser.groups must specify 'allow' or 'maxcount'");
+        return false;
+    }
+    if (!strcmp("allow", val)) {
+        if (!(val = Config.GetWord())) {
+            m_log.Emsg("Config", "multiuser.groups allow must specify at least one GID range");
+            return false;
+        }
+        do {
+            std::stringstream ranges(val);
+            std::string range;
+            while (std::getline(ranges, range, ',')) {
+                auto dash = range.find('-');
+                gid_t first, last;
+                if (!parse_gid(range.substr(0, dash), first)) {return false;}
+                if (dash == std::string::npos) {
+                    last = first;
+                } else if (!parse_gid(range.substr(dash + 1), last)) {
+                    return false;
+                }
+                if (last < first) {
+                    m_log.Emsg("Config", "multiuser.groups allow range is reversed:", range.c_str());
+                    return false;
+                }
+                cache.AllowGroups(first, last);
+            }
+        } while ((val = Config.GetWord()));
+    } else if (!strcmp("maxcount", val)) {
+        val = Config.GetWord();
+        if (!val || !val[0]) {
+            m_log.Emsg("Config", "multiuser.groups maxcount must specify a value");
+            return false;
+        }
+        char *endptr = NULL;
+        errno = 0;
+        long int count = strtol(val, &endptr, 10);
+        if (errno || (endptr && *endptr != '\0') || (count < 0)) {
+            m_log.Emsg("Config", "multiuser.groups maxcount must specify a non-negative integer");
+            return false;
+        }
+        cache.SetMaxGroups(count);
+    } else {
+        m_log.Emsg("Config", "multiuser.groups encountered an unknown option:", val);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Parse the arguments of the multiuser.idcache directive:
+ *
+ *   multiuser.idcache [ttl <sec>] [negttl <sec>] [maxentries <n>] | off
+ */
+bool
+MultiuserFileSystem::ConfigIdCache(XrdOucStream &Config)
+{
+    auto &cache = IdentityCache::Instance();
+    const char *val = Config.GetWord();
+    if (!val || !val[0]) {
+        m_log.Emsg("Config", "multiuser.idcache must specify at least one option");
+        return false;
+    }
+    do {
+        if (!strcmp("off", val)) {
+            cache.SetPositiveTTL(0);
+            cache.SetNegativeTTL(0);
+            continue;
+        }
+        std::string option(val);
+        if ((option != "ttl") && (option != "negttl") && (option != "maxentries")) {
+            m_log.Emsg("Config", "multiuser.idcache encountered an unknown option:", val);
+            return false;
+        }
+        val = Config.GetWord();
+        if (!val || !val[0]) {
+            m_log.Emsg("Config", "multiuser.idcache option", option.c_str(), "must specify a value");
+            return false;
+        }
+        char *endptr = NULL;
+        errno = 0;
+        long int num = strtol(val, &endptr, 10);
+        if (errno || (endptr && *endptr != '\0') || (num < 0) || (num > std::numeric_limits<int>::max())) {
+            m_log.Emsg("Config", "multiuser.idcache option", option.c_str(), "must specify a non-negative integer");
+            return false;
+        }
+        if (option == "ttl") {cache.SetPositiveTTL(num);}
+        else if (option == "negttl") {cache.SetNegativeTTL(num);}
+        else {cache.SetMaxEntries(num);}
+    } while ((val = Config.GetWord()));
+    return true;
+}
 // Object Allocation Functions
 //
 XrdOssDF *MultiuserFileSystem::newDir(const char *user)
 {
     // Call the underlying OSS newDir
     std::unique_ptr<XrdOssDF> wrapped(m_oss->newDir(user));
-    return (MultiuserDirectory *)new MultiuserDirectory(user, std::move(wrapped), m_log);
+    return (MultiuserDirectory *)new MultiuserDirectory(user, std::move(wrapped), m_log, this);
 }
 
 XrdOssDF *MultiuserFileSystem::newFile(const char *user)
@@ -247,35 +1217,43 @@ int MultiuserFileSystem::Chmod(const char * path, mode_t mode, XrdOucEnv *env)
     std::unique_ptr<UserSentry> sentryPtr;
     if (env) {
         auto client = env->secEnv();
-        sentryPtr.reset(new UserSentry(client, m_log));
+        sentryPtr.reset(new UserSentry(client, m_log, UserSentry::Dispatch));
         if (!sentryPtr->IsValid()) return -EPERM;
+    } else {
+        UserSentry::ResetThreadIdentity(m_log);
     }
-    return m_oss->Chmod(path, mode, env);
+    auto rc = RunAsUser(sentryPtr.get(), [&] {return m_oss->Chmod(path, mode, env);});
+    FileCache::Instance().Invalidate(path);
+    return rc;
 }
 
 void      MultiuserFileSystem::Connect(XrdOucEnv &env)
 {
     auto client = env.secEnv();
-    UserSentry sentry(client, m_log);
+    // Resolve the session's identity once; later operations reuse it.
+    SessionIdentityMap::Instance().Register(client);
+    UserSentry sentry(client, m_log, UserSentry::Dispatch);
     if (!sentry.IsValid()) return;
-    m_oss->Connect(env);
+    RunAsUser(&sentry, [&] {m_oss->Connect(env); return 0;});
 }
 
 int       MultiuserFileSystem::Create(const char *tid, const char *path, mode_t mode, XrdOucEnv &env,
                         int opts)
 {
     auto client = env.secEnv();
-    UserSentry sentry(client, m_log);
+    UserSentry sentry(client, m_log, UserSentry::Dispatch);
     if (!sentry.IsValid()) return -EACCES;
-    return m_oss->Create(tid, path, mode, env, opts);
+    return RunAsUser(&sentry, [&] {return m_oss->Create(tid, path, mode, env, opts);});
 }
 
 void      MultiuserFileSystem::Disc(XrdOucEnv &env)
 {
     auto client = env.secEnv();
-    UserSentry sentry(client, m_log);
-    if (!sentry.IsValid()) return;
-    m_oss->Disc(env);
+    {
+        UserSentry sentry(client, m_log, UserSentry::Dispatch);
+        if (sentry.IsValid()) RunAsUser(&sentry, [&] {m_oss->Disc(env); return 0;});
+    }
+    SessionIdentityMap::Instance().Remove(client);
 }
 
 void      MultiuserFileSystem::EnvInfo(XrdOucEnv *env)
@@ -284,19 +1262,24 @@ void      MultiuserFileSystem::EnvInfo(XrdOucEnv *env)
     std::unique_ptr<UserSentry> sentryPtr;
     if (env) {
         auto client = env->secEnv();
-        sentryPtr.reset(new UserSentry(client, m_log));
+        sentryPtr.reset(new UserSentry(client, m_log, UserSentry::Dispatch));
         if (!sentryPtr->IsValid()) return;
+    } else {
+        UserSentry::ResetThreadIdentity(m_log);
     }
-    m_oss->EnvInfo(env);
+    RunAsUser(sentryPtr.get(), [&] {m_oss->EnvInfo(env); return 0;});
 }
 
 uint64_t  MultiuserFileSystem::Features()
 {
+    // MultiuserFile exposes the wrapped descriptor (getFD), so the wrapped
+    // OSS's sendfile support (no XRDOSS_HASNOSF) carries over unchanged.
     return m_oss->Features();
 }
 
 int       MultiuserFileSystem::FSctl(int cmd, int alen, const char *args, char **resp)
 {
+    UserSentry::ResetThreadIdentity(m_log);
     return m_oss->FSctl(cmd, alen, args, resp);
 }
 
@@ -317,8 +1300,10 @@ int       MultiuserFileSystem::Mkdir(const char *path, mode_t mode, int mkpath,
     std::unique_ptr<UserSentry> sentryPtr;
     if (env) {
         auto client = env->secEnv();
-        sentryPtr.reset(new UserSentry(client, m_log));
+        sentryPtr.reset(new UserSentry(client, m_log, UserSentry::Dispatch));
         if (!sentryPtr->IsValid()) return -EACCES;
+    } else {
+        UserSentry::ResetThreadIdentity(m_log);
     }
 
     // Heuristic - if the createMode is the default from Xrootd, apply umask.
@@ -326,12 +1311,13 @@ int       MultiuserFileSystem::Mkdir(const char *path, mode_t mode, int mkpath,
     {
         mode |= 0777;
     }
-    return m_oss->Mkdir(path, mode, mkpath, env);
+    return RunAsUser(sentryPtr.get(), [&] {return m_oss->Mkdir(path, mode, mkpath, env);});
 }
 
 int       MultiuserFileSystem::Reloc(const char *tident, const char *path,
                     const char *cgName, const char *anchor)
 {
+    UserSentry::ResetThreadIdentity(m_log);
     return m_oss->Reloc(tident, path, cgName, anchor);
     
 }
@@ -341,10 +1327,12 @@ int       MultiuserFileSystem::Remdir(const char *path, int Opts, XrdOucEnv *env
     std::unique_ptr<UserSentry> sentryPtr;
     if (env) {
         auto client = env->secEnv();
-        sentryPtr.reset(new UserSentry(client, m_log));
+        sentryPtr.reset(new UserSentry(client, m_log, UserSentry::Dispatch));
         if (!sentryPtr->IsValid()) return -EACCES;
+    } else {
+        UserSentry::ResetThreadIdentity(m_log);
     }
-    return m_oss->Remdir(path, Opts, env);
+    return RunAsUser(sentryPtr.get(), [&] {return m_oss->Remdir(path, Opts, env);});
 }
 
 int       MultiuserFileSystem::Rename(const char *oPath, const char *nPath,
@@ -354,10 +1342,15 @@ int       MultiuserFileSystem::Rename(const char *oPath, const char *nPath,
     std::unique_ptr<UserSentry> sentryPtr;
     if (oEnvP) {
         auto client = oEnvP->secEnv();
-        sentryPtr.reset(new UserSentry(client, m_log));
+        sentryPtr.reset(new UserSentry(client, m_log, UserSentry::Dispatch));
         if (!sentryPtr->IsValid()) return -EACCES;
+    } else {
+        UserSentry::ResetThreadIdentity(m_log);
     }
-    return m_oss->Rename(oPath, nPath, oEnvP, nEnvP);
+    auto rc = RunAsUser(sentryPtr.get(), [&] {return m_oss->Rename(oPath, nPath, oEnvP, nEnvP);});
+    FileCache::Instance().Invalidate(oPath);
+    FileCache::Instance().Invalidate(nPath);
+    return rc;
 }
 
 int       MultiuserFileSystem::Stat(const char *path, struct stat *buff,
@@ -367,20 +1360,38 @@ int       MultiuserFileSystem::Stat(const char *path, struct stat *buff,
     std::unique_ptr<DacOverrideSentry> overridePtr;
     if (env) {
         auto client = env->secEnv();
-        sentryPtr.reset(new UserSentry(client, m_log));
+        sentryPtr.reset(new UserSentry(client, m_log, UserSentry::Dispatch));
         if (!sentryPtr->IsValid()) return -EACCES;
     } else if (UserSentry::IsCmsd()) {
         // The cmsd must be able to override the access control as it needs
         // the ability to advertise the availability of any existing file.
         overridePtr.reset(new DacOverrideSentry(m_log));
         if (!overridePtr->IsValid()) return -EACCES;
+    } else {
+        UserSentry::ResetThreadIdentity(m_log);
     }
-    return m_oss->Stat(path, buff, opts, env);
+    return RunAsUser(sentryPtr.get(), [&] {return m_oss->Stat(path, buff, opts, env);});
 }
 
 int       MultiuserFileSystem::Stats(char *buff, int blen)
 {
-    return m_oss->Stats(buff, blen);
+    std::stringstream ss;
+    ss << "<stats id=\"multiuser\">";
+    IdentityCache::Instance().Stats(ss);
+    if (CachePolicy::IsEnabled()) {CachePolicy::Stats(ss);}
+    if (FileCache::Instance().IsEnabled()) {FileCache::Instance().Stats(ss);}
+    GroupCommit::Stats(ss);
+    if (RateLimiter::Instance().IsEnabled()) {RateLimiter::Instance().Stats(ss);}
+    ss << "</stats>";
+    auto stats = ss.str();
+
+    // With no buffer, report the maximum length needed; leave headroom as
+    // the counters may grow before the next call.
+    auto wrapped_len = m_oss->Stats(buff, blen);
+    if (!buff) {return wrapped_len + stats.size() + 256;}
+    if ((wrapped_len < 0) || (blen - wrapped_len <= static_cast<int>(stats.size()))) {return wrapped_len;}
+    memcpy(buff + wrapped_len, stats.c_str(), stats.size() + 1);
+    return wrapped_len + stats.size();
 }
 
 int       MultiuserFileSystem::StatFS(const char *path, char *buff, int &blen,
@@ -389,33 +1400,38 @@ int       MultiuserFileSystem::StatFS(const char *path, char *buff, int &blen,
     std::unique_ptr<UserSentry> sentryPtr;
     if (env) {
         auto client = env->secEnv();
-        sentryPtr.reset(new UserSentry(client, m_log));
+        sentryPtr.reset(new UserSentry(client, m_log, UserSentry::Dispatch));
         if (!sentryPtr->IsValid()) return -EACCES;
+    } else {
+        UserSentry::ResetThreadIdentity(m_log);
     }
-    return m_oss->StatFS(path, buff, blen, env);
+    return RunAsUser(sentryPtr.get(), [&] {return m_oss->StatFS(path, buff, blen, env);});
 }
 
 int       MultiuserFileSystem::StatLS(XrdOucEnv &env, const char *path,
                         char *buff, int &blen)
 {
     auto client = env.secEnv();
-    UserSentry sentry(client, m_log);
+    UserSentry sentry(client, m_log, UserSentry::Dispatch);
     if (!sentry.IsValid()) return -EACCES;
-    return m_oss->StatLS(env, path, buff, blen);
+    return RunAsUser(&sentry, [&] {return m_oss->StatLS(env, path, buff, blen);});
 }
 
 int       MultiuserFileSystem::StatPF(const char *path, struct stat *buff, int opts)
 {
+    UserSentry::ResetThreadIdentity(m_log);
     return m_oss->StatPF(path, buff, opts);
 }
 
 int       MultiuserFileSystem::StatPF(const char *path, struct stat *buff)
 {
+    UserSentry::ResetThreadIdentity(m_log);
     return m_oss->StatPF(path, buff, 0);
 }
 
 int       MultiuserFileSystem::StatVS(XrdOssVSInfo *vsP, const char *sname, int updt)
 {
+    UserSentry::ResetThreadIdentity(m_log);
     return m_oss->StatVS(vsP, sname, updt);
 }
 
@@ -425,10 +1441,12 @@ int       MultiuserFileSystem::StatXA(const char *path, char *buff, int &blen,
     std::unique_ptr<UserSentry> sentryPtr;
     if (env) {
         auto client = env->secEnv();
-        sentryPtr.reset(new UserSentry(client, m_log));
+        sentryPtr.reset(new UserSentry(client, m_log, UserSentry::Dispatch));
         if (!sentryPtr->IsValid()) return -EACCES;
+    } else {
+        UserSentry::ResetThreadIdentity(m_log);
     }
-    return m_oss->StatXA(path, buff, blen, env);
+    return RunAsUser(sentryPtr.get(), [&] {return m_oss->StatXA(path, buff, blen, env);});
 }
 
 int       MultiuserFileSystem::StatXP(const char *path, unsigned long long &attr,
@@ -437,10 +1455,12 @@ int       MultiuserFileSystem::StatXP(const char *path, unsigned long long &attr
     std::unique_ptr<UserSentry> sentryPtr;
     if (env) {
         auto client = env->secEnv();
-        sentryPtr.reset(new UserSentry(client, m_log));
+        sentryPtr.reset(new UserSentry(client, m_log, UserSentry::Dispatch));
         if (!sentryPtr->IsValid()) return -EACCES;
+    } else {
+        UserSentry::ResetThreadIdentity(m_log);
     }
-    return m_oss->StatXP(path, attr, env);
+    return RunAsUser(sentryPtr.get(), [&] {return m_oss->StatXP(path, attr, env);});
 }
 
 int       MultiuserFileSystem::Truncate(const char *path, unsigned long long fsize,
@@ -449,10 +1469,14 @@ int       MultiuserFileSystem::Truncate(const char *path, unsigned long long fsi
     std::unique_ptr<UserSentry> sentryPtr;
     if (env) {
         auto client = env->secEnv();
-        sentryPtr.reset(new UserSentry(client, m_log));
+        sentryPtr.reset(new UserSentry(client, m_log, UserSentry::Dispatch));
         if (!sentryPtr->IsValid()) return -EACCES;
+    } else {
+        UserSentry::ResetThreadIdentity(m_log);
     }
-    return m_oss->Truncate(path, fsize, env);
+    auto rc = RunAsUser(sentryPtr.get(), [&] {return m_oss->Truncate(path, fsize, env);});
+    FileCache::Instance().Invalidate(path);
+    return rc;
 }
 
 int       MultiuserFileSystem::Unlink(const char *path, int Opts, XrdOucEnv *env)
@@ -460,10 +1484,14 @@ int       MultiuserFileSystem::Unlink(const char *path, int Opts, XrdOucEnv *env
     std::unique_ptr<UserSentry> sentryPtr;
     if (env) {
         auto client = env->secEnv();
-        sentryPtr.reset(new UserSentry(client, m_log));
+        sentryPtr.reset(new UserSentry(client, m_log, UserSentry::Dispatch));
         if (!sentryPtr->IsValid()) return -EACCES;
+    } else {
+        UserSentry::ResetThreadIdentity(m_log);
     }
-    return m_oss->Unlink(path, Opts, env);
+    auto rc = RunAsUser(sentryPtr.get(), [&] {return m_oss->Unlink(path, Opts, env);});
+    FileCache::Instance().Invalidate(path);
+    return rc;
 }
 
 int       MultiuserFileSystem::Lfn2Pfn(const char *Path, char *buff, int blen)
@@ -13,6 +13,8 @@
 #include "XrdCks/XrdCksWrapper.hh"
 #include "MultiuserFileSystem.hh"
 
+#include "GroupCommit.hh"
+
 #include <memory>
 
 class MultiuserFileSystem : public XrdOss {
@@ -64,6 +66,18 @@ public:
     const char       *Lfn2Pfn(const char *Path, char *buff, int blen, int &rc);
 
 private:
+    bool ConfigIdCache(XrdOucStream &Config);
+    bool ConfigGroups(XrdOucStream &Config);
+    bool ConfigReadahead(XrdOucStream &Config);
+    bool ConfigWriteBuffer(XrdOucStream &Config);
+    bool ConfigDirectIO(XrdOucStream &Config);
+    bool ConfigFileCache(XrdOucStream &Config);
+    bool ConfigIoClass(XrdOucStream &Config);
+    bool ConfigRateLimit(XrdOucStream &Config);
+    bool ConfigGroupCommit(XrdOucStream &Config, unsigned &window, GroupCommit::Mode &mode);
+    bool ConfigIoUring(XrdOucStream &Config, unsigned &depth);
+    bool ConfigWorkerPool(XrdOucStream &Config, unsigned &threads, unsigned &max_per_user);
+
     mode_t m_umask_mode;
     XrdOss *m_oss;  // NOTE: we DO NOT own this pointer; given by the caller.  Do not make std::unique_ptr!
     XrdOucEnv *m_env;
@@ -71,6 +85,10 @@ private:
     std::shared_ptr<XrdAccAuthorize> m_authz;
     bool m_checksum_on_write;
     unsigned m_digests;
+    // The library of another OSS plugin set with ofs.osslib, and of an SFS
+    // plugin set with xrootd.fslib, if any.
+    std::string m_stacked_oss;
+    std::string m_stacked_sfs;
 
 };
 
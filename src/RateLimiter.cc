@@ -0,0 +1,154 @@
+#include "RateLimiter.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+
+RateLimiter &
+RateLimiter::Instance()
+{
+    static RateLimiter limiter;
+    return limiter;
+}
+
+
+long long
+RateLimiter::Now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+long long
+RateLimiter::Bucket::Take(size_t bytes, long long now)
+{
+    m_bytes += bytes;
+    long long cost = static_cast<long long>(static_cast<double>(bytes) * 1e9 / m_rate);
+    long long tat = m_tat.load();
+    long long next;
+    do {
+        // An idle bucket's credit is capped at the burst.
+        next = std::max(tat, now - m_burst_ns) + cost;
+    } while (!m_tat.compare_exchange_weak(tat, next));
+    long long wait = next - now;
+    if (wait <= 0) {return 0;}
+    m_throttled++;
+    m_delay_ns += wait;
+    return wait;
+}
+
+
+void
+RateLimiter::SetGroupRate(gid_t gid, unsigned long long rate)
+{
+    if (rate) {m_groups[gid].reset(new Bucket(rate, m_burst_ns));}
+    else {m_groups.erase(gid);}
+}
+
+
+void
+RateLimiter::Clear()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_user_rate = 0;
+    m_users.clear();
+    m_groups.clear();
+}
+
+
+void
+RateLimiter::ApplyBurst()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    for (auto &user : m_users) {user.second->m_burst_ns = m_burst_ns;}
+    for (auto &group : m_groups) {group.second->m_burst_ns = m_burst_ns;}
+}
+
+
+RateLimiter::Buckets
+RateLimiter::Get(const UserIdentity &identity)
+{
+    Buckets buckets;
+    if (m_user_rate) {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto iter = m_users.find(identity.m_uid);
+        if (iter == m_users.end()) {
+            if (m_users.size() >= m_prune_at) {PruneUsers(Now());}
+            iter = m_users.emplace(identity.m_uid, std::make_shared<Bucket>(m_user_rate, m_burst_ns)).first;
+        }
+        buckets.push_back(iter->second);
+    }
+    for (const auto &group : m_groups) {
+        if ((group.first == identity.m_gid) ||
+            (std::find(identity.m_groups.begin(), identity.m_groups.end(), group.first) != identity.m_groups.end()))
+        {
+            buckets.push_back(group.second);
+        }
+    }
+    return buckets;
+}
+
+
+void
+RateLimiter::PruneUsers(long long now)
+{
+    for (auto iter = m_users.begin(); iter != m_users.end();) {
+        // Only Get, under m_mutex, hands out new references to a bucket.
+        auto &bucket = iter->second;
+        if ((bucket.use_count() == 1) && (bucket->m_tat.load() <= now - bucket->m_burst_ns)) {
+            iter = m_users.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+    m_prune_at = std::max<size_t>(1024, 2 * m_users.size());
+}
+
+
+void
+RateLimiter::Throttle(const Buckets &buckets, size_t bytes)
+{
+    if (buckets.empty() || !bytes) {return;}
+    long long now = Now();
+    long long wait = 0;
+    for (const auto &bucket : buckets) {wait = std::max(wait, bucket->Take(bytes, now));}
+    if (wait > 0) {std::this_thread::sleep_for(std::chrono::nanoseconds(wait));}
+}
+
+
+void
+RateLimiter::BucketStats(std::ostream &os, Bucket &bucket, long long now)
+{
+    unsigned long long bytes = bucket.m_bytes.load();
+    unsigned long long rate = 0;
+    if (bucket.m_reported_at && (now > bucket.m_reported_at)) {
+        rate = static_cast<unsigned long long>((bytes - bucket.m_reported_bytes) * 1e9 / (now - bucket.m_reported_at));
+    }
+    bucket.m_reported_bytes = bytes;
+    bucket.m_reported_at = now;
+    os << "<limit>" << bucket.m_rate << "</limit><bytes>" << bytes << "</bytes><rate>" << rate
+       << "</rate><throttled>" << bucket.m_throttled.load() << "</throttled><delay_ms>"
+       << bucket.m_delay_ns.load() / 1000000 << "</delay_ms>";
+}
+
+
+void
+RateLimiter::Stats(std::ostream &os)
+{
+    long long now = Now();
+    std::lock_guard<std::mutex> guard(m_mutex);
+    os << "<ratelimit>";
+    for (const auto &user : m_users) {
+        os << "<user id=\"" << user.first << "\">";
+        BucketStats(os, *user.second, now);
+        os << "</user>";
+    }
+    for (const auto &group : m_groups) {
+        os << "<group id=\"" << group.first << "\">";
+        BucketStats(os, *group.second, now);
+        os << "</group>";
+    }
+    os << "</ratelimit>";
+}
@@ -0,0 +1,106 @@
+#ifndef __MULTIUSERRATELIMITER_HH__
+#define __MULTIUSERRATELIMITER_HH__
+
+#include "IdentityCache.hh"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include <sys/types.h>
+
+
+/**
+ * Per-user and per-group bandwidth limits on file I/O (multiuser.ratelimit).
+ *
+ * Every UID gets its own token bucket with the configured user rate; each
+ * configured group has one bucket shared by all users in that group.  A
+ * file takes references to its opener's buckets at open time, and each
+ * read or write takes its size from all of them, sleeping until the
+ * slowest one allows it.
+ *
+ * The buckets are a single atomic each (the time at which the bucket's
+ * debt is paid off), updated with compare-and-swap, so concurrent transfers
+ * never take a lock; the only lock is for finding or creating a user's
+ * bucket on open.  A bucket left idle accumulates up to `burst` worth of
+ * credit.
+ *
+ * A user's bucket that no open file refers to and that has regained its
+ * full burst is indistinguishable from a new one, so such buckets are
+ * dropped whenever the number of users doubles; the map stays bounded by
+ * the users with open files or recent I/O.
+ */
+class RateLimiter {
+public:
+    class Bucket {
+    public:
+        Bucket(unsigned long long rate, long long burst_ns) :
+            m_rate(rate),
+            m_burst_ns(burst_ns)
+        {}
+
+        // Take `bytes` from the bucket; returns how many nanoseconds the
+        // caller has to wait before using them.
+        long long Take(size_t bytes, long long now);
+
+        const unsigned long long m_rate;
+        long long m_burst_ns;
+        std::atomic<long long> m_tat{0};
+        std::atomic<unsigned long long> m_bytes{0};
+        std::atomic<unsigned long long> m_throttled{0};
+        std::atomic<unsigned long long> m_delay_ns{0};
+
+        // Used by Stats to compute the rate since the previous report.
+        unsigned long long m_reported_bytes{0};
+        long long m_reported_at{0};
+    };
+    typedef std::vector<std::shared_ptr<Bucket>> Buckets;
+
+    static RateLimiter &Instance();
+
+    // Rates are in bytes per second; zero removes the limit.
+    void SetUserRate(unsigned long long rate) {m_user_rate = rate;}
+    void SetGroupRate(gid_t gid, unsigned long long rate);
+    // Remove every user and group limit.
+    void Clear();
+    void SetBurst(unsigned milliseconds) {m_burst_ns = static_cast<long long>(milliseconds) * 1000000;}
+    // Give the existing buckets the current burst; called once configuration is done.
+    void ApplyBurst();
+    bool IsEnabled() const {return m_user_rate || !m_groups.empty();}
+    unsigned long long GetUserRate() const {return m_user_rate;}
+    size_t GetGroupCount() const {return m_groups.size();}
+    unsigned GetBurst() const {return m_burst_ns / 1000000;}
+
+    // The buckets limiting I/O by `identity`.
+    Buckets Get(const UserIdentity &identity);
+
+    // Account for `bytes` of I/O, sleeping as long as the buckets require.
+    static void Throttle(const Buckets &buckets, size_t bytes);
+
+    // Append the buckets' rates and delays to a statistics report.
+    void Stats(std::ostream &os);
+
+private:
+    RateLimiter() {}
+    RateLimiter(const RateLimiter &) = delete;
+    RateLimiter &operator=(const RateLimiter &) = delete;
+
+    static long long Now();
+    // Drop idle user buckets; called with m_mutex held.
+    void PruneUsers(long long now);
+    static void BucketStats(std::ostream &os, Bucket &bucket, long long now);
+
+    unsigned long long m_user_rate{0};
+    long long m_burst_ns{100000000};
+
+    std::mutex m_mutex;
+    std::map<uid_t, std::shared_ptr<Bucket>> m_users;
+    size_t m_prune_at{1024};
+    // Fixed after configuration.
+    std::map<gid_t, std::shared_ptr<Bucket>> m_groups;
+};
+
+#endif
@@ -0,0 +1,74 @@
+#include "Readahead.hh"
+
+#include <algorithm>
+
+#include <fcntl.h>
+
+size_t Readahead::m_max_window = 0;
+size_t Readahead::m_budget = 0;
+std::atomic<size_t> Readahead::m_in_use{0};
+
+
+void
+Readahead::OnRead(int fd, off_t offset, size_t size)
+{
+    if ((fd < 0) || !size) {return;}
+    std::lock_guard<std::mutex> guard(m_mutex);
+
+    off_t end = offset + size;
+    if (offset != m_next_offset) {
+        // Random access: stop prefetching until a new sequential run shows up.
+        m_next_offset = end;
+        m_streak = 0;
+        if (m_window) {
+            m_in_use -= m_window;
+            m_window = 0;
+        }
+        m_advised_end = 0;
+        return;
+    }
+    m_next_offset = end;
+    if (++m_streak < m_min_streak) {return;}
+
+    // Still well inside what was already advised; nothing to do.
+    if (m_window && (end + static_cast<off_t>(m_window / 2) <= m_advised_end)) {return;}
+
+    // Start at twice the read size and double each time the reader catches
+    // up, as far as the per-file maximum and the global budget allow.
+    size_t target = m_window ? 2 * m_window : 2 * size;
+    target = std::min(target, m_max_window);
+    if (target > m_window) {
+        size_t grow = target - m_window;
+        size_t in_use = m_in_use.load();
+        while (true) {
+            if (in_use >= m_budget) {
+                grow = 0;
+                break;
+            }
+            grow = std::min(grow, m_budget - in_use);
+            if (m_in_use.compare_exchange_weak(in_use, in_use + grow)) {break;}
+        }
+        m_window += grow;
+    }
+    if (!m_window) {return;}
+
+    off_t start = std::max(end, m_advised_end);
+    off_t stop = end + m_window;
+    if (stop <= start) {return;}
+    posix_fadvise(fd, start, stop - start, POSIX_FADV_WILLNEED);
+    m_advised_end = stop;
+}
+
+
+void
+Readahead::Reset()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_window) {
+        m_in_use -= m_window;
+        m_window = 0;
+    }
+    m_next_offset = -1;
+    m_streak = 0;
+    m_advised_end = 0;
+}
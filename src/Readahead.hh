@@ -0,0 +1,61 @@
+#ifndef __MULTIUSERREADAHEAD_HH__
+#define __MULTIUSERREADAHEAD_HH__
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+
+#include <sys/types.h>
+
+
+/**
+ * Per-file sequential read detection and readahead (multiuser.readahead).
+ *
+ * Once a file has been read sequentially a few times, the region past the
+ * current read is passed to posix_fadvise(POSIX_FADV_WILLNEED) so the kernel
+ * fetches it while the client is still processing the previous chunk.  The
+ * window starts at twice the read size and doubles each time the reader
+ * moves past the advised region, up to a per-file maximum; a non-sequential
+ * read drops it again.  The sum of all files' windows is bounded by a global
+ * budget so many concurrent streams cannot flood the page cache.
+ */
+class Readahead {
+public:
+    static void Configure(size_t max_window, size_t budget)
+    {
+        m_max_window = max_window;
+        m_budget = budget;
+    }
+    static bool IsEnabled() {return m_max_window && m_budget;}
+    static size_t GetMaxWindow() {return m_max_window;}
+    static size_t GetBudget() {return m_budget;}
+
+    Readahead() {}
+    ~Readahead() {Reset();}
+
+    // Record a completed read of `size` bytes at `offset` on `fd` and issue
+    // readahead for what a sequential reader will need next.
+    void OnRead(int fd, off_t offset, size_t size);
+
+    // Drop the window and return its share of the budget.
+    void Reset();
+
+private:
+    Readahead(const Readahead &) = delete;
+    Readahead &operator=(const Readahead &) = delete;
+
+    // Sequential reads in a row before readahead starts.
+    static const unsigned m_min_streak = 2;
+
+    std::mutex m_mutex;
+    off_t m_next_offset{0};
+    unsigned m_streak{0};
+    size_t m_window{0};
+    off_t m_advised_end{0};
+
+    static size_t m_max_window;
+    static size_t m_budget;
+    static std::atomic<size_t> m_in_use;
+};
+
+#endif
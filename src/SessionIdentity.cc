@@ -0,0 +1,78 @@
+#include "SessionIdentity.hh"
+#include "UserSentry.hh"
+
+
+SessionIdentityMap &
+SessionIdentityMap::Instance()
+{
+    static SessionIdentityMap sessions;
+    return sessions;
+}
+
+
+std::shared_ptr<const SessionIdentity>
+SessionIdentityMap::Resolve(const XrdSecEntity *client, bool got_token, const std::string &username)
+{
+    auto &cache = IdentityCache::Instance();
+    std::shared_ptr<SessionIdentity> session(new SessionIdentity());
+    session->m_ueid = client->ueid;
+    session->m_from_token = got_token;
+    session->m_username = username;
+    session->m_identity = cache.Get(username);
+    // Re-resolve on the same schedule the identity cache would have.
+    auto ttl = session->m_identity->IsValid() ? cache.GetPositiveTTL() : cache.GetNegativeTTL();
+    session->m_expiry = std::chrono::steady_clock::now() + std::chrono::seconds(ttl);
+    return session;
+}
+
+
+void
+SessionIdentityMap::Register(const XrdSecEntity *client)
+{
+    if (!client) {return;}
+
+    std::string username;
+    auto got_token = client->eaAPI->Get("request.name", username);
+    // Anonymous sessions are cheap to handle per operation; don't track them.
+    if (UserSentry::MapUsername(client, got_token, username) != UserSentry::Mapped) {return;}
+
+    auto session = Resolve(client, got_token, username);
+    auto &shard = GetShard(client);
+    std::lock_guard<std::mutex> guard(shard.m_mutex);
+    shard.m_sessions[client] = session;
+}
+
+
+std::shared_ptr<const SessionIdentity>
+SessionIdentityMap::Get(const XrdSecEntity *client)
+{
+    auto &shard = GetShard(client);
+    std::shared_ptr<const SessionIdentity> session;
+    {
+        std::lock_guard<std::mutex> guard(shard.m_mutex);
+        auto iter = shard.m_sessions.find(client);
+        if (iter == shard.m_sessions.end()) {return session;}
+        session = iter->second;
+    }
+    // Guard against a stale entry whose entity object has been reused.
+    if (session->m_ueid != client->ueid) {return nullptr;}
+    if (std::chrono::steady_clock::now() < session->m_expiry) {return session;}
+
+    auto refreshed = Resolve(client, session->m_from_token, session->m_username);
+    std::lock_guard<std::mutex> guard(shard.m_mutex);
+    auto iter = shard.m_sessions.find(client);
+    if ((iter != shard.m_sessions.end()) && (iter->second == session)) {
+        iter->second = refreshed;
+    }
+    return refreshed;
+}
+
+
+void
+SessionIdentityMap::Remove(const XrdSecEntity *client)
+{
+    if (!client) {return;}
+    auto &shard = GetShard(client);
+    std::lock_guard<std::mutex> guard(shard.m_mutex);
+    shard.m_sessions.erase(client);
+}
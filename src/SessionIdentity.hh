@@ -0,0 +1,82 @@
+#ifndef __MULTIUSERSESSIONIDENTITY_HH__
+#define __MULTIUSERSESSIONIDENTITY_HH__
+
+#include "IdentityCache.hh"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+class XrdSecEntity;
+
+
+/**
+ * The identity a client session was resolved to at Connect time.
+ *
+ * Entries are immutable once published; when the identity needs to be
+ * refreshed, a new SessionIdentity replaces the old one in the map.
+ */
+struct SessionIdentity {
+    unsigned int m_ueid{0};
+    // True if m_username came from the request.name attribute (a token)
+    // rather than the entity name.
+    bool m_from_token{false};
+    std::string m_username;
+    std::shared_ptr<const UserIdentity> m_identity;
+    std::chrono::steady_clock::time_point m_expiry;
+
+    // Whether this session identity still applies to a request whose
+    // request.name lookup returned (got_token, username).
+    bool Matches(bool got_token, const std::string &username) const
+    {
+        if (got_token != m_from_token) {return false;}
+        return !got_token || (username == m_username);
+    }
+};
+
+
+/**
+ * Map from XrdSecEntity to the identity resolved for that session.  Populated
+ * by MultiuserFileSystem::Connect and cleared by Disc so per-operation
+ * UserSentry objects can skip the username mapping and NSS lookups.
+ */
+class SessionIdentityMap {
+public:
+    static SessionIdentityMap &Instance();
+
+    // Resolve and remember the identity for a newly-connected client.
+    void Register(const XrdSecEntity *client);
+
+    // Returns the current identity for the client's session, or null if the
+    // session is unknown (e.g., Connect was never called for it).
+    std::shared_ptr<const SessionIdentity> Get(const XrdSecEntity *client);
+
+    void Remove(const XrdSecEntity *client);
+
+private:
+    SessionIdentityMap() {}
+    SessionIdentityMap(const SessionIdentityMap &) = delete;
+    SessionIdentityMap &operator=(const SessionIdentityMap &) = delete;
+
+    std::shared_ptr<const SessionIdentity> Resolve(const XrdSecEntity *client, bool got_token, const std::string &username);
+
+    // The map is sharded by entity address to keep the per-operation lookup
+    // from serializing all worker threads on one mutex.
+    static const unsigned m_shard_count = 16;
+    struct Shard {
+        std::mutex m_mutex;
+        std::unordered_map<const XrdSecEntity *, std::shared_ptr<const SessionIdentity>> m_sessions;
+    };
+    Shard &GetShard(const XrdSecEntity *client)
+    {
+        auto addr = reinterpret_cast<uintptr_t>(client);
+        return m_shards[(addr >> 6) % m_shard_count];
+    }
+
+    Shard m_shards[m_shard_count];
+};
+
+#endif
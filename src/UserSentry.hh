@@ -11,6 +11,9 @@
 #include "XrdVersion.hh"
 #include "XrdOss/XrdOss.hh"
 #include "XrdCks/XrdCksWrapper.hh"
+#include "IdentityCache.hh"
+#include "IoClass.hh"
+#include "SessionIdentity.hh"
 
 #include <dlfcn.h>
 #include <fcntl.h>
@@ -24,44 +27,15 @@
 #include <unistd.h>
 
 
-/**
- * Note: originally, we tried to use CAP_DAC_READ_SEARCH as that provides exactly what we need -
- * the ability to override the read/execute permissions of directories.  However, it turns out
- * that shared filesystems (at least, NFS and CephFS) don't understand Linux capabilities, ignore
- * the setting, and go solely by the FS UID/GID.  Hence, we *must* use the big hammer of setfsuid
- * instead of the svelte CAP_DAC_READ_SEARCH.
- */
-class DacOverrideSentry {
-public:
-    DacOverrideSentry(XrdSysError &log) :
-        m_log(log)
-    {
-        //m_log.Emsg("UserSentry", "Switching FS uid for root");
-        m_orig_uid = setfsuid(0);
-        if (m_orig_uid < 0) {
-            //m_log.Emsg("UserSentry", "Failed to switch FS uid for root");
-            return;
-        }
-    }
-
-    ~DacOverrideSentry()
-    {
-        if ((m_orig_uid != -1) && (-1 == setfsuid(m_orig_uid))) {
-            m_log.Emsg("UserSentry", "Failed to return fsuid to original state", strerror(errno));
-        }
-    }
-
-    bool IsValid() const {return m_orig_uid != -1;}
-
-private:
-    int m_orig_uid{-1};
-    XrdSysError &m_log;
-};
-
-
 class UserSentry {
 public:
-    UserSentry(const XrdSecEntity *client, XrdSysError &log) :
+    // With Dispatch, a sentry for a valid user does not switch the calling
+    // thread's credentials when the identity worker pool is enabled; the
+    // caller must run the operation through RunAsUser (IdentityWorkerPool.hh).
+    enum Mode {Switch, Dispatch};
+
+    UserSentry(const XrdSecEntity *client, XrdSysError &log, Mode mode=Switch) :
+        m_dispatch(mode == Dispatch),
         m_log(log)
     {
         if (!client) {
@@ -71,39 +45,76 @@ public:
         // get the username from the extra attributes in the client
         std::string username;
         auto got_token = client->eaAPI->Get("request.name", username);
-        if (!got_token && (!client->name || !client->name[0])) {
-            // Anonymous client; no user set
-            this->Init("", log);
-            return;
-        }
 
-        // If we used GSI, and we didn't get a token (in ?authz=Bearer%20...),
-        // and user was not mapped by VOMS or gridmap,
-        // consider the client anonymous
-        if (strcmp("gsi", client->prot) == 0 && !got_token) {
-            if (!IsGsiUserMapped(client)) {
-                log.Emsg("UserSentry", "Anonymous GSI client; cannot change FS UIDs");
-                m_is_anonymous = true;
-                return;
-            }
+        // If this session's identity was resolved at Connect and the request
+        // did not switch to a different token user, reuse it as-is.
+        auto session = SessionIdentityMap::Instance().Get(client);
+        if (session && session->Matches(got_token, username)) {
+            this->Apply(session->m_identity, session->m_username);
+            return;
         }
 
-        // If we fail to get the username from the scitokens, then get it from
-        // the depreciated way, client->name
-        if (!got_token) {
-            username = client->name;
+        switch (MapUsername(client, got_token, username)) {
+        case Anonymous:
+            // Anonymous client; no user set
+            this->Init("", log);
+            return;
+        case AnonymousGsi:
+            log.Emsg("UserSentry", "Anonymous GSI client; cannot change FS UIDs");
+            m_is_anonymous = true;
+            m_resolution.m_anonymous = true;
+            ResetThreadIdentity(m_log);
+            return;
+        case Mapped:
+            break;
         }
         this->Init(username, log);
     }
 
-    UserSentry(const std::string username, XrdSysError &log) :
+    UserSentry(const std::string username, XrdSysError &log, Mode mode=Switch) :
+        m_dispatch(mode == Dispatch),
         m_log(log)
     {
         this->Init(username, log);
     }
 
+    // What a sentry resolved its client to.  Long-lived handles (e.g.
+    // directory listings) keep it so later operations can skip the username
+    // mapping and identity lookups.
+    struct Resolution {
+        bool m_anonymous{false};
+        std::string m_username;
+        std::shared_ptr<const UserIdentity> m_identity;
+    };
+
+    UserSentry(const Resolution &resolution, XrdSysError &log, Mode mode=Switch) :
+        m_dispatch(mode == Dispatch),
+        m_log(log)
+    {
+        if (resolution.m_anonymous) {
+            m_is_anonymous = true;
+            m_resolution.m_anonymous = true;
+            ResetThreadIdentity(m_log);
+        } else if (resolution.m_identity) {
+            this->Apply(resolution.m_identity, resolution.m_username);
+        }
+    }
+
+    const Resolution &GetResolution() const {return m_resolution;}
+
     static bool ConfigCaps(XrdSysError &log, XrdOucEnv *envP);
 
+    // Capabilities are per-thread; make sure CAP_SETUID and CAP_SETGID are
+    // effective for the calling thread.  After the first success, libcap is
+    // not consulted again: switching the fsuid away from 0 only clears the
+    // filesystem-related capabilities, never CAP_SETUID / CAP_SETGID.
+    static bool ThreadCaps(XrdSysError &log)
+    {
+        if (m_thread_caps) {return true;}
+        m_thread_caps = AcquireThreadCaps(log);
+        return m_thread_caps;
+    }
+
     static bool IsCmsd() {return m_is_cmsd;}
 
     // Configure the minimum UID/GID a mapped username may resolve to.  Any
@@ -114,6 +125,33 @@ public:
     static uid_t GetMinimumUid() {return m_min_uid;}
     static gid_t GetMinimumGid() {return m_min_gid;}
 
+    enum MappingResult {Mapped, Anonymous, AnonymousGsi};
+
+    // Determine the username a client maps to, given the result of looking
+    // up its request.name attribute (got_token / username).
+    static MappingResult MapUsername(const XrdSecEntity *client, bool got_token, std::string &username)
+    {
+        if (!got_token && (!client->name || !client->name[0])) {
+            return Anonymous;
+        }
+
+        // If we used GSI, and we didn't get a token (in ?authz=Bearer%20...),
+        // and user was not mapped by VOMS or gridmap,
+        // consider the client anonymous
+        if (strcmp("gsi", client->prot) == 0 && !got_token) {
+            if (!IsGsiUserMapped(client)) {
+                return AnonymousGsi;
+            }
+        }
+
+        // If we fail to get the username from the scitokens, then get it from
+        // the depreciated way, client->name
+        if (!got_token) {
+            username = client->name;
+        }
+        return Mapped;
+    }
+
     static bool IsGsiUserMapped(const XrdSecEntity *client) {
         // If VOMS was used to map client, return true
         if (client->vorg) { return true; }
@@ -136,80 +174,76 @@ public:
 
     void Init(const std::string username, XrdSysError &log)
     {
-        struct passwd pwd, *result = nullptr;
-
-        // TODO: cache the lot of this.
-        int buflen = sysconf(_SC_GETPW_R_SIZE_MAX);
-        if (buflen < 0) {buflen = 16384;}
-        std::vector<char> buf(buflen);
-
-        int retval;
-
         if (username.empty()) {
             log.Emsg("UserSentry", "Anonymous client; no user set, cannot change FS UIDs");
             m_is_anonymous = true;
+            m_resolution.m_anonymous = true;
+            ResetThreadIdentity(m_log);
             return;
         }
 
-        do {
-            retval = getpwnam_r(username.c_str(), &pwd, &buf[0], buflen, &result);
-            if ((result == nullptr) && (retval == ERANGE)) {
-                buflen *= 2;
-                buf.resize(buflen);
-                continue;
-            }
+        this->Apply(IdentityCache::Instance().Get(username), username);
+    }
+
+    void Apply(const std::shared_ptr<const UserIdentity> &identity, const std::string &username)
+    {
+        switch (identity->m_status) {
+        case UserIdentity::Valid:
             break;
-        } while (1);
-        if (result == nullptr) {
-            if (retval) {  // There's an actual error in the lookup.
-                m_log.Emsg("UserSentry", "Multiuser denying access: Failure when looking up UID for username", username.c_str(), strerror(retval));
-            } else {  // Username doesn't exist.
-                m_log.Emsg("UserSentry", "Multiuser denying access: XRootD mapped request to username that does not exist:", username.c_str());
-            }
+        case UserIdentity::LookupFailed:
+            m_log.Emsg("UserSentry", "Multiuser denying access: Failure when looking up UID for username", username.c_str(), strerror(identity->m_errno));
             return;
-        }
-        if (pwd.pw_uid < m_min_uid) {
+        case UserIdentity::NoSuchUser:
+            m_log.Emsg("UserSentry", "Multiuser denying access: XRootD mapped request to username that does not exist:", username.c_str());
+            return;
+        case UserIdentity::SystemUid:
             m_log.Emsg("UserSentry", "Multiuser denying access: Username", username.c_str(), "maps to a system UID; rejecting lookup");
             return;
-        }
-        if (pwd.pw_gid < m_min_gid) {
+        case UserIdentity::SystemGid:
             m_log.Emsg("UserSentry", "Multiuser denying access: Username", username.c_str(), "maps to a system GID; rejecting lookup");
             return;
+        case UserIdentity::GroupsFailed:
+            m_log.Emsg("UserSentry", "Multiuser denying access: Failure when looking up supplementary groups for username", username.c_str());
+            return;
         }
 
-        // Get supplementary groups for user
-        int ngroups = 16;
-        std::vector<gid_t> groups(ngroups);
-        do {
-            int old_ngroups = ngroups;
-            retval = getgrouplist(username.c_str(), pwd.pw_gid, groups.data(), &ngroups);
-            if (-1 == retval && ngroups > old_ngroups) {
-                // Too many groups. Resize buffer and try again.
-                groups.resize(ngroups);
-                continue;
-            }
-            break;
-        } while (1);
-        if (-1 == retval) {
-            m_log.Emsg("UserSentry", "Multiuser denying access: Failure when looking up supplementary groups for username", username.c_str());
+        m_resolution.m_username = username;
+        m_resolution.m_identity = identity;
+
+        if (m_dispatch && m_dispatch_enabled) {
+            m_identity = identity;
+            m_is_dispatched = true;
             return;
         }
 
         // Note: Capabilities need to be set per thread, so we need to do this
-        ConfigCaps(m_log, nullptr);
+        ThreadCaps(m_log);
+
+        if (m_sticky) {
+            m_is_sticky = HoldThreadIdentity(identity, username.c_str(), m_log);
+            if (m_is_sticky) {
+                m_orig_uid = m_thread_identity.m_orig_uid;
+                m_orig_gid = m_thread_identity.m_orig_gid;
+            }
+            return;
+        }
 
         // TODO: One log line per FS open seems noisy -- could make this configurable.
         m_log.Emsg("UserSentry", "Switching FS uid for user", username.c_str());
-        m_orig_uid = setfsuid(result->pw_uid);
+        m_orig_uid = setfsuid(identity->m_uid);
         if (m_orig_uid < 0) {
             m_log.Emsg("UserSentry", "Multiuser denying access: Failed to switch FS uid for user", username.c_str());
             return;
         }
-        m_orig_gid = setfsgid(result->pw_gid);
-        ThreadSetgroups(ngroups, groups.data());
+        m_orig_gid = setfsgid(identity->m_gid);
+        ThreadSetgroups(identity->m_groups.size(), identity->m_groups.data());
+        if (identity->m_ioprio) {m_orig_ioprio = IoClass::Set(identity->m_ioprio, m_log);}
     }
 
     ~UserSentry() {
+        // A sticky identity is kept by the thread until a different one is
+        // needed or ResetThreadIdentity is called.
+        if (m_is_sticky || m_is_dispatched) {return;}
         if ((m_orig_uid != -1) && (-1 == setfsuid(m_orig_uid))) {
             m_log.Emsg("UserSentry", "Failed to return fsuid to original state", strerror(errno));
         }
@@ -220,18 +254,129 @@ public:
         // We don't need to restore the daemon's original groups, as the
         // *-privileged processes run without supplementary groups defined.
         ThreadSetgroups(0, nullptr);
+        if (m_orig_ioprio != -1) {IoClass::Restore(m_orig_ioprio, m_log);}
     }
 
-    bool IsValid() const {return ((m_orig_gid != -1) && (m_orig_uid != -1)) || m_is_anonymous;}
+    bool IsValid() const {return ((m_orig_gid != -1) && (m_orig_uid != -1)) || m_is_anonymous || m_is_dispatched;}
+
+    // The identity the operation must run as if the credential switch was
+    // left to the worker pool; null otherwise.
+    const std::shared_ptr<const UserIdentity> &DispatchIdentity() const {return m_identity;}
+
+    static void SetDispatchEnabled(bool enabled) {m_dispatch_enabled = enabled;}
+
+    // When sticky identities are enabled (multiuser.stickyidentity), a thread
+    // keeps the fsuid/fsgid/groups of the last user it served after the
+    // UserSentry is destroyed; the next sentry only issues the credential
+    // syscalls if it needs a different identity.  Any code path which touches
+    // the filesystem without a UserSentry must call ResetThreadIdentity first.
+    static void SetSticky(bool sticky) {m_sticky = sticky;}
+    static bool IsSticky() {return m_sticky;}
+
+    static void ResetThreadIdentity(XrdSysError &log)
+    {
+        if (!m_thread_identity.m_identity) {return;}
+        m_thread_identity.m_identity.reset();
+        if (-1 == setfsuid(m_thread_identity.m_orig_uid)) {
+            log.Emsg("UserSentry", "Failed to return fsuid to original state", strerror(errno));
+        }
+        if (-1 == setfsgid(m_thread_identity.m_orig_gid)) {
+            log.Emsg("UserSentry", "Failed to return fsgid to original state", strerror(errno));
+        }
+        ThreadSetgroups(0, nullptr);
+        HoldThreadIoPriority(0, log);
+    }
+
+    // Switch the thread to the given identity unless it already holds an
+    // equivalent one; the identity is kept until the next call or
+    // ResetThreadIdentity.  Returns false if the switch failed.  The
+    // username is only used for logging; if null, the UID is logged.
+    static bool HoldThreadIdentity(const std::shared_ptr<const UserIdentity> &identity, const char *username, XrdSysError &log)
+    {
+        auto &current = m_thread_identity.m_identity;
+        if (current == identity) {return true;}
+        if (current && (current->m_uid == identity->m_uid) && (current->m_gid == identity->m_gid) &&
+            (current->m_groups == identity->m_groups))
+        {
+            current = identity;
+            HoldThreadIoPriority(identity->m_ioprio, log);
+            return true;
+        }
+
+        std::string name(username ? username : ("uid " + std::to_string(identity->m_uid)));
+        log.Emsg("UserSentry", "Switching FS uid for user", name.c_str());
+        int orig_uid = setfsuid(identity->m_uid);
+        if (orig_uid < 0) {
+            log.Emsg("UserSentry", "Multiuser denying access: Failed to switch FS uid for user", name.c_str());
+            ResetThreadIdentity(log);
+            return false;
+        }
+        int orig_gid = setfsgid(identity->m_gid);
+        ThreadSetgroups(identity->m_groups.size(), identity->m_groups.data());
+        // Only remember the daemon's IDs, not those of a previously held user.
+        if (!current) {
+            m_thread_identity.m_orig_uid = orig_uid;
+            m_thread_identity.m_orig_gid = orig_gid;
+        }
+        current = identity;
+        HoldThreadIoPriority(identity->m_ioprio, log);
+        return true;
+    }
 
 private:
+    static bool AcquireThreadCaps(XrdSysError &log);
+
+    // Keep the thread at the given multiuser.ioclass priority (0 for the
+    // thread's original one) until the held identity changes.
+    static void HoldThreadIoPriority(int ioprio, XrdSysError &log)
+    {
+        auto &held = m_thread_identity;
+        if (ioprio == held.m_ioprio) {return;}
+        if (!ioprio) {
+            IoClass::Restore(held.m_orig_ioprio, log);
+            held.m_ioprio = 0;
+            held.m_orig_ioprio = -1;
+            return;
+        }
+        int orig_ioprio = IoClass::Set(ioprio, log);
+        if (orig_ioprio == -1) {return;}
+        // Only remember the thread's own priority, not that of a previous user.
+        if (held.m_orig_ioprio == -1) {held.m_orig_ioprio = orig_ioprio;}
+        held.m_ioprio = ioprio;
+    }
+
+    struct ThreadIdentity {
+        std::shared_ptr<const UserIdentity> m_identity;
+        int m_orig_uid{-1};
+        int m_orig_gid{-1};
+        // The priority applied for m_identity (0 if none) and the one to
+        // restore, or -1 if the thread's priority was not changed.
+        int m_ioprio{0};
+        int m_orig_ioprio{-1};
+    };
+
     // Note I am not using `uid_t` and `gid_t` here in order
     // to have the ability to denote an invalid ID (-1)
     int m_orig_uid{-1};
     int m_orig_gid{-1};
+    int m_orig_ioprio{-1};
     bool m_is_anonymous{false};
+    bool m_is_sticky{false};
+    bool m_dispatch{false};
+    bool m_is_dispatched{false};
+    std::shared_ptr<const UserIdentity> m_identity;
+    Resolution m_resolution;
 
     static bool m_is_cmsd;
+    // Set when the identity worker pool (multiuser.workerpool) is running.
+    static bool m_dispatch_enabled;
+
+    // Sticky identity mode and the identity currently held by this thread;
+    // definitions live in multiuser.cpp.
+    static bool m_sticky;
+    static thread_local ThreadIdentity m_thread_identity;
+    // Whether CAP_SETUID / CAP_SETGID are known to be effective for this thread.
+    static thread_local bool m_thread_caps;
 
     // Minimum UID/GID thresholds; configurable via multiuser.minuid /
     // multiuser.mingid.  Definitions (and defaults) live in multiuser.cpp.
@@ -241,4 +386,39 @@ private:
     XrdSysError &m_log;
 };
 
+/**
+ * Note: originally, we tried to use CAP_DAC_READ_SEARCH as that provides exactly what we need -
+ * the ability to override the read/execute permissions of directories.  However, it turns out
+ * that shared filesystems (at least, NFS and CephFS) don't understand Linux capabilities, ignore
+ * the setting, and go solely by the FS UID/GID.  Hence, we *must* use the big hammer of setfsuid
+ * instead of the svelte CAP_DAC_READ_SEARCH.
+ */
+class DacOverrideSentry {
+public:
+    DacOverrideSentry(XrdSysError &log) :
+        m_log(log)
+    {
+        //m_log.Emsg("UserSentry", "Switching FS uid for root");
+        UserSentry::ResetThreadIdentity(m_log);
+        m_orig_uid = setfsuid(0);
+        if (m_orig_uid < 0) {
+            //m_log.Emsg("UserSentry", "Failed to switch FS uid for root");
+            return;
+        }
+    }
+
+    ~DacOverrideSentry()
+    {
+        if ((m_orig_uid != -1) && (-1 == setfsuid(m_orig_uid))) {
+            m_log.Emsg("UserSentry", "Failed to return fsuid to original state", strerror(errno));
+        }
+    }
+
+    bool IsValid() const {return m_orig_uid != -1;}
+
+private:
+    int m_orig_uid{-1};
+    XrdSysError &m_log;
+};
+
 #endif
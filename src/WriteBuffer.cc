@@ -0,0 +1,111 @@
+#include "WriteBuffer.hh"
+
+#include "XrdOss/XrdOss.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+size_t WriteBuffer::m_size = 0;
+size_t WriteBuffer::m_budget = 0;
+std::atomic<size_t> WriteBuffer::m_in_use{0};
+
+
+ssize_t
+WriteBuffer::Write(const void *buffer, off_t offset, size_t size)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_error) {return m_error;}
+    auto data = static_cast<const char *>(buffer);
+
+    if (m_len && (offset != m_offset + static_cast<off_t>(m_len))) {
+        int rc = FlushLocked();
+        if (rc) {return rc;}
+    }
+    // Large writes gain nothing from a copy.
+    if (size >= m_size || (!m_data && !Reserve())) {
+        int rc = FlushLocked();
+        if (rc) {return rc;}
+        return WriteThrough(data, offset, size);
+    }
+
+    size_t remaining = size;
+    while (remaining) {
+        if (!m_len) {
+            m_offset = offset;
+            m_limit = m_size - (offset % m_size);
+        }
+        size_t chunk = std::min(remaining, m_limit - m_len);
+        memcpy(m_data.get() + m_len, data, chunk);
+        m_len += chunk;
+        data += chunk;
+        offset += chunk;
+        remaining -= chunk;
+        if (m_len == m_limit) {
+            int rc = FlushLocked();
+            if (rc) {return rc;}
+        }
+    }
+    return size;
+}
+
+
+int
+WriteBuffer::Flush()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return FlushLocked();
+}
+
+
+int
+WriteBuffer::Release()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    int rc = FlushLocked();
+    if (m_data) {
+        m_data.reset();
+        m_in_use -= m_size;
+    }
+    return rc;
+}
+
+
+int
+WriteBuffer::FlushLocked()
+{
+    if (m_error) {return m_error;}
+    if (!m_len) {return 0;}
+    auto result = WriteThrough(m_data.get(), m_offset, m_len);
+    m_len = 0;
+    // The writes being flushed were already acknowledged, so the failure
+    // has to be reported by whatever comes next, up to Close.
+    if (result < 0) {m_error = result;}
+    return m_error;
+}
+
+
+ssize_t
+WriteBuffer::WriteThrough(const char *buffer, off_t offset, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        auto result = m_file.Write(buffer + done, offset + done, size - done);
+        if (result <= 0) {return result ? result : -EIO;}
+        done += result;
+    }
+    return size;
+}
+
+
+bool
+WriteBuffer::Reserve()
+{
+    size_t in_use = m_in_use.load();
+    while (true) {
+        if (in_use + m_size > m_budget) {return false;}
+        if (m_in_use.compare_exchange_weak(in_use, in_use + m_size)) {break;}
+    }
+    m_data.reset(new char[m_size]);
+    return true;
+}
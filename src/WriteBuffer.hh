@@ -0,0 +1,75 @@
+#ifndef __MULTIUSERWRITEBUFFER_HH__
+#define __MULTIUSERWRITEBUFFER_HH__
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+
+#include <sys/types.h>
+
+class XrdOssDF;
+
+
+/**
+ * Per-file write-behind buffer (multiuser.writebuffer).
+ *
+ * Contiguous writes smaller than the buffer are copied into it and reach the
+ * wrapped file as one large write once the buffer fills.  The first fill
+ * after a flush stops at the next multiple of the buffer size, so later
+ * writes land on aligned offsets.  The buffer is flushed whenever a write
+ * leaves a gap, and before anything which must see the data in the file
+ * (reads, stat, truncate, sync, close).
+ *
+ * A failed flush is remembered and returned by every later operation,
+ * including Close, since the writes it covers were already acknowledged.
+ * The memory held by all buffers is bounded by a global budget; a file which
+ * cannot get a buffer simply writes through.
+ */
+class WriteBuffer {
+public:
+    static void Configure(size_t size, size_t budget)
+    {
+        m_size = size;
+        m_budget = budget;
+    }
+    static bool IsEnabled() {return m_size && m_budget;}
+    static size_t GetSize() {return m_size;}
+    static size_t GetBudget() {return m_budget;}
+
+    WriteBuffer(XrdOssDF &file) : m_file(file) {}
+    ~WriteBuffer() {Release();}
+
+    // Write or buffer `size` bytes at `offset`.  Returns `size`, or the
+    // negative errno of this or an earlier failed write.
+    ssize_t Write(const void *buffer, off_t offset, size_t size);
+
+    // Write out anything buffered.  Returns 0 or the negative errno of this
+    // or an earlier failed write.
+    int Flush();
+
+    // Flush and give the memory back to the budget.
+    int Release();
+
+private:
+    WriteBuffer(const WriteBuffer &) = delete;
+    WriteBuffer &operator=(const WriteBuffer &) = delete;
+
+    int FlushLocked();
+    ssize_t WriteThrough(const char *buffer, off_t offset, size_t size);
+    bool Reserve();
+
+    XrdOssDF &m_file;
+    std::mutex m_mutex;
+    std::unique_ptr<char[]> m_data;
+    off_t m_offset{0};
+    size_t m_len{0};
+    size_t m_limit{0};
+    int m_error{0};
+
+    static size_t m_size;
+    static size_t m_budget;
+    static std::atomic<size_t> m_in_use;
+};
+
+#endif
@@ -3,12 +3,17 @@
 
 #include <sstream>
 #include <algorithm>
-#include <fstream>
+#include <memory>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "XrdVersion.hh"
 
 #include "XrdChecksum.hh"
 #include "MultiuserFileSystem.hh"
+#include "CachePolicy.hh"
 
 #include "XrdOss/XrdOss.hh"
 #include "XrdSfs/XrdSfsInterface.hh"
@@ -89,25 +94,46 @@ int        ChecksumManager::Calc( const char *lfn, XrdCksData &Cks, int doSet)
 
     ChecksumState state(digests);
     // Open the file to read
-    std::ifstream is (pfn, std::ios::binary | std::ios::in);
-    if (is.fail()) {
+    int fd = open(pfn.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        int err = errno;
         std::stringstream ss;
-        ss << "Failed to open file: " << pfn << "  error: " << strerror(errno);
+        ss << "Failed to open file: " << pfn << "  error: " << strerror(err);
         m_log.Emsg("Calc", ss.str().c_str());
-        return -errno;
-    } 
+        return -err;
+    }
+
+    // A whole-file scan of a large file should not push everyone else's
+    // data out of the page cache.
+    std::unique_ptr<CachePolicy> policy;
+    struct stat st;
+    if (CachePolicy::IsEnabled() && !fstat(fd, &st) && CachePolicy::Applies(st.st_size)) {
+        policy.reset(new CachePolicy(fd, true, CachePolicy::Checksum));
+    }
 
     const static int buffer_size = 256*1024;
     std::vector<char> read_buffer;
     read_buffer.resize(buffer_size);
 
     // Read through the file, checksumming as we go
-    while(!is.eof()) {
-        is.read(&read_buffer[0], buffer_size);
-        int bytes_read = is.gcount();
+    off_t offset = 0;
+    while (true) {
+        ssize_t bytes_read = read(fd, &read_buffer[0], buffer_size);
+        if (bytes_read < 0) {
+            if (errno == EINTR) {continue;}
+            int err = errno;
+            std::stringstream ss;
+            ss << "Failed to read file: " << pfn << "  error: " << strerror(err);
+            m_log.Emsg("Calc", ss.str().c_str());
+            close(fd);
+            return -err;
+        }
+        if (!bytes_read) {break;}
         state.Update((unsigned char*)(&read_buffer[0]), bytes_read);
+        if (policy) {policy->OnRead(offset, bytes_read);}
+        offset += bytes_read;
     }
-    is.close();
+    close(fd);
 
     state.Finalize();
     this->Set(lfn, state);
@@ -0,0 +1,232 @@
+/*
+ * Generate the binary identity map read by the multiuser.idmap directive.
+ *
+ * Usage:
+ *   xrootd-multiuser-idmap [-i <input>] -o <output>
+ *
+ * Without -i, every account in the password database (getpwent) is written
+ * along with its supplementary groups (getgrouplist).  With -i, the input is
+ * a text file with one account per line:
+ *
+ *   <username> <uid> <gid> [<gid>,<gid>,...]
+ *
+ * The primary GID is always part of the group list, as with getgrouplist.
+ * Blank lines and lines starting with '#' are ignored.  The output is written
+ * to a temporary file and renamed into place so running servers pick up the
+ * new map atomically.
+ */
+
+#include "IdMapFormat.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <grp.h>
+#include <pwd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct Account {
+    std::string m_name;
+    uint64_t m_hash;
+    uint32_t m_uid;
+    uint32_t m_gid;
+    std::vector<uint32_t> m_groups;
+};
+
+
+static bool
+ReadPasswd(std::vector<Account> &accounts)
+{
+    setpwent();
+    struct passwd *pwd;
+    while ((pwd = getpwent())) {
+        Account account;
+        account.m_name = pwd->pw_name;
+        account.m_uid = pwd->pw_uid;
+        account.m_gid = pwd->pw_gid;
+        int ngroups = 16;
+        std::vector<gid_t> groups(ngroups);
+        int retval;
+        do {
+            int old_ngroups = ngroups;
+            retval = getgrouplist(pwd->pw_name, pwd->pw_gid, groups.data(), &ngroups);
+            if (-1 == retval && ngroups > old_ngroups) {
+                groups.resize(ngroups);
+                continue;
+            }
+            break;
+        } while (1);
+        if (-1 == retval) {
+            std::cerr << "Failed to look up supplementary groups for " << pwd->pw_name << "; skipping" << std::endl;
+            continue;
+        }
+        account.m_groups.assign(groups.begin(), groups.begin() + ngroups);
+        accounts.push_back(account);
+    }
+    endpwent();
+    return true;
+}
+
+
+// Parse a decimal UID or GID.  strtoul alone would accept a sign and wrap
+// "-1" around; (uint32_t)-1 itself means "no ID" to the kernel.
+static bool
+ParseId(const std::string &text, uint32_t &id)
+{
+    if (text.empty() || (text[0] < '0') || (text[0] > '9')) {return false;}
+    char *endptr = nullptr;
+    errno = 0;
+    unsigned long val = strtoul(text.c_str(), &endptr, 10);
+    if (errno || *endptr || (val >= UINT32_MAX)) {return false;}
+    id = val;
+    return true;
+}
+
+
+static bool
+ReadText(const char *fname, std::vector<Account> &accounts)
+{
+    std::ifstream input(fname);
+    if (!input) {
+        std::cerr << "Failed to open " << fname << std::endl;
+        return false;
+    }
+    std::string line;
+    unsigned lineno = 0;
+    while (std::getline(input, line)) {
+        lineno++;
+        if (line.empty() || line[0] == '#') {continue;}
+        std::istringstream ss(line);
+        Account account;
+        std::string uid, gid, groups;
+        if (!(ss >> account.m_name >> uid >> gid)) {
+            std::cerr << fname << ":" << lineno << ": expected '<username> <uid> <gid> [<gid>,...]'" << std::endl;
+            return false;
+        }
+        if (!ParseId(uid, account.m_uid)) {
+            std::cerr << fname << ":" << lineno << ": invalid user ID '" << uid << "'" << std::endl;
+            return false;
+        }
+        if (!ParseId(gid, account.m_gid)) {
+            std::cerr << fname << ":" << lineno << ": invalid group ID '" << gid << "'" << std::endl;
+            return false;
+        }
+        account.m_groups.push_back(account.m_gid);
+        if (ss >> groups) {
+            std::istringstream gs(groups);
+            while (std::getline(gs, gid, ',')) {
+                uint32_t val;
+                if (!ParseId(gid, val)) {
+                    std::cerr << fname << ":" << lineno << ": invalid group ID '" << gid << "'" << std::endl;
+                    return false;
+                }
+                if (val != account.m_gid) {account.m_groups.push_back(val);}
+            }
+        }
+        accounts.push_back(account);
+    }
+    return true;
+}
+
+
+static bool
+WriteMap(const char *fname, std::vector<Account> &accounts)
+{
+    for (auto &account : accounts) {
+        account.m_hash = IdMapHash(account.m_name.c_str(), account.m_name.size());
+    }
+    std::sort(accounts.begin(), accounts.end(), [](const Account &left, const Account &right) {
+        return (left.m_hash < right.m_hash) || ((left.m_hash == right.m_hash) && (left.m_name < right.m_name));
+    });
+    accounts.erase(std::unique(accounts.begin(), accounts.end(), [](const Account &left, const Account &right) {
+        return left.m_name == right.m_name;
+    }), accounts.end());
+
+    std::vector<IdMapRecord> records;
+    std::vector<uint32_t> groups;
+    std::string strings;
+    for (const auto &account : accounts) {
+        IdMapRecord record;
+        memset(&record, 0, sizeof(record));
+        record.m_hash = account.m_hash;
+        record.m_name_off = strings.size();
+        record.m_name_len = account.m_name.size();
+        record.m_uid = account.m_uid;
+        record.m_gid = account.m_gid;
+        record.m_groups_idx = groups.size();
+        record.m_ngroups = account.m_groups.size();
+        records.push_back(record);
+        groups.insert(groups.end(), account.m_groups.begin(), account.m_groups.end());
+        strings += account.m_name;
+    }
+
+    IdMapHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.m_magic, IDMAP_MAGIC, sizeof(header.m_magic));
+    header.m_version = IDMAP_VERSION;
+    header.m_count = records.size();
+    header.m_records_off = sizeof(header);
+    header.m_groups_off = header.m_records_off + records.size() * sizeof(IdMapRecord);
+    header.m_groups_count = groups.size();
+    header.m_strings_off = header.m_groups_off + groups.size() * sizeof(uint32_t);
+    header.m_strings_len = strings.size();
+
+    std::string tmpname = std::string(fname) + ".XXXXXX";
+    int fd = mkstemp(&tmpname[0]);
+    if (fd < 0) {
+        std::cerr << "Failed to create temporary file " << tmpname << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    FILE *fp = fdopen(fd, "w");
+    bool ok = fp &&
+        (fwrite(&header, sizeof(header), 1, fp) == 1) &&
+        (records.empty() || fwrite(records.data(), sizeof(IdMapRecord), records.size(), fp) == records.size()) &&
+        (groups.empty() || fwrite(groups.data(), sizeof(uint32_t), groups.size(), fp) == groups.size()) &&
+        (strings.empty() || fwrite(strings.data(), 1, strings.size(), fp) == strings.size()) &&
+        (fchmod(fd, 0644) == 0) && (fflush(fp) == 0) && (fsync(fd) == 0);
+    if (fp) {ok = (fclose(fp) == 0) && ok;}
+    else {close(fd);}
+    if (!ok || (rename(tmpname.c_str(), fname) < 0)) {
+        std::cerr << "Failed to write " << fname << ": " << strerror(errno) << std::endl;
+        unlink(tmpname.c_str());
+        return false;
+    }
+    std::cout << "Wrote " << records.size() << " identities to " << fname << std::endl;
+    return true;
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *input = nullptr, *output = nullptr;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:o:h")) != -1) {
+        switch (opt) {
+        case 'i':
+            input = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            std::cerr << "Usage: " << argv[0] << " [-i <input>] -o <output>" << std::endl;
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (!output) {
+        std::cerr << "Usage: " << argv[0] << " [-i <input>] -o <output>" << std::endl;
+        return 1;
+    }
+
+    std::vector<Account> accounts;
+    if (!(input ? ReadText(input, accounts) : ReadPasswd(accounts))) {return 1;}
+    return WriteMap(output, accounts) ? 0 : 1;
+}
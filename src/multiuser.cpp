@@ -13,7 +13,9 @@
 #include "MultiuserFileSystem.hh"
 #include "MultiuserFile.hh"
 #include "UserSentry.hh"
+#include "IdentityWorkerPool.hh"
 
+#include <algorithm>
 #include <exception>
 #include <memory>
 #include <mutex>
@@ -21,10 +23,20 @@
 #include <sstream>
 #include <iomanip>
 
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
 MultiuserFileSystem* g_multisuer_oss = nullptr;
 ChecksumManager* g_checksum_manager = nullptr;
 
 bool UserSentry::m_is_cmsd = false;
+bool UserSentry::m_sticky = false;
+bool UserSentry::m_dispatch_enabled = false;
+thread_local UserSentry::ThreadIdentity UserSentry::m_thread_identity;
+thread_local bool UserSentry::m_thread_caps = false;
 
 // Default minimum UID/GID.  Usernames mapping to an ID below these values are
 // rejected as system accounts.  Override via multiuser.minuid / multiuser.mingid.
@@ -52,6 +64,12 @@ bool UserSentry::ConfigCaps(XrdSysError &log, XrdOucEnv *envP) {
     }
     m_is_cmsd = myProg && !strcmp(myProg, "cmsd");
 
+    m_thread_caps = AcquireThreadCaps(log);
+    return m_thread_caps;
+}
+
+
+bool UserSentry::AcquireThreadCaps(XrdSysError &log) {
     // See if we have the appropriate capabilities to run this plugin.
     cap_t caps = cap_get_proc();
     if (caps == NULL) {
@@ -138,7 +156,56 @@ private:
 };
 
 
-MultiuserFile::MultiuserFile(const char *user, std::unique_ptr<XrdOssDF> ossDF, XrdSysError &log, mode_t umask_mode, bool checksum_on_write, unsigned digests, MultiuserFileSystem *oss) :
+IdentityWorkerPool *MultiuserFile::m_aio_pool = nullptr;
+size_t MultiuserFile::m_prealloc_min = 0;
+
+void MultiuserFile::ConfigAio(unsigned threads, XrdSysError &log)
+{
+    if (m_aio_pool || !threads) {return;}
+    m_aio_pool = IdentityWorkerPool::Create(threads, 0, log);
+    std::stringstream ss;
+    ss << "Running asynchronous I/O requests on " << threads << " identity-pinned completion threads";
+    log.Emsg("Config", ss.str().c_str());
+}
+
+bool MultiuserFile::SubmitAio(XrdSfsAio *aiop, bool is_read, std::function<ssize_t()> op)
+{
+    if (!m_aio_pool || !m_resolution.m_identity) {return false;}
+    bool start;
+    {
+        std::lock_guard<std::mutex> guard(m_aio_mutex);
+        m_aio_queue.push_back(AioRequest{aiop, is_read, std::move(op)});
+        start = (m_aio_queue.size() == 1);
+    }
+    if (start) {m_aio_pool->Submit(m_resolution.m_identity, [this](bool ok) {this->RunAio(ok);});}
+    return true;
+}
+
+void MultiuserFile::RunAio(bool ok)
+{
+    while (true) {
+        AioRequest request;
+        {
+            std::lock_guard<std::mutex> guard(m_aio_mutex);
+            request = m_aio_queue.front();
+        }
+        request.m_aiop->Result = ok ? request.m_op() : -EACCES;
+        bool more;
+        {
+            std::lock_guard<std::mutex> guard(m_aio_mutex);
+            m_aio_queue.pop_front();
+            more = !m_aio_queue.empty();
+        }
+        // Once the last request completes, the file may be closed and
+        // deleted; it must not be touched after that.
+        if (request.m_is_read) {request.m_aiop->doneRead();}
+        else {request.m_aiop->doneWrite();}
+        if (!more) {return;}
+    }
+}
+
+MultiuserFile::MultiuserFile(const char *user, std::unique_ptr<XrdOssDF> ossDF, XrdSysError &log, mode_t umask_mode,
+                             bool checksum_on_write, unsigned digests, MultiuserFileSystem *oss) :
     XrdOssDF(user),
     m_wrapped(std::move(ossDF)),
     m_log(log),
@@ -147,7 +214,8 @@ MultiuserFile::MultiuserFile(const char *user, std::unique_ptr<XrdOssDF> ossDF,
     m_nextoff(0),
     m_oss(oss),
     m_checksum_on_write(checksum_on_write),
-    m_digests(digests)
+    m_digests(digests),
+    m_preallocated(0)
 {}
 
 int     MultiuserFile::Open(const char *path, int Oflag, mode_t Mode, XrdOucEnv &env)
@@ -158,10 +226,45 @@ int     MultiuserFile::Open(const char *path, int Oflag, mode_t Mode, XrdOucEnv
     }
     m_fname = path;
     m_client = env.secEnv();
-    UserSentry sentry(m_client, m_log);
+    UserSentry sentry(m_client, m_log, UserSentry::Dispatch);
     if (!sentry.IsValid()) return -EACCES;
+    m_resolution = sentry.GetResolution();
+    if (m_resolution.m_identity) {m_ioprio = m_resolution.m_identity->m_ioprio;}
+
+    auto &rate_limiter = RateLimiter::Instance();
+    if (rate_limiter.IsEnabled() && m_resolution.m_identity) {
+        m_rate_limits = rate_limiter.Get(*m_resolution.m_identity);
+    }
 
-    auto open_result = m_wrapped->Open(path, Oflag, Mode, env);
+    // Hot small files may be served from a descriptor this user already
+    // opened; anything else opening the path may change it.
+    auto &file_cache = FileCache::Instance();
+    bool cacheable = file_cache.IsEnabled() && m_resolution.m_identity &&
+                     ((Oflag & O_ACCMODE) == O_RDONLY) && !(Oflag & (O_CREAT | O_TRUNC));
+    if (cacheable && OpenCached(path, sentry)) {return XrdOssOK;}
+    if (!cacheable) {file_cache.Invalidate(path);}
+
+    auto open_result = RunAsUser(&sentry, [&] {
+        auto result = m_wrapped->Open(path, Oflag, Mode, env);
+        if ((result == XrdOssOK) && (Oflag & (O_WRONLY | O_RDWR))) {Preallocate(env);}
+        if ((result == XrdOssOK) && DirectIO::IsEnabled()) {OpenDirect(path, Oflag, env);}
+        return result;
+    });
+    if (open_result == XrdOssOK) {
+        if (cacheable) {file_cache.Put(*m_resolution.m_identity, path, m_wrapped->getFD());}
+        // Direct I/O bypasses the page cache and is only used for large
+        // transfers; neither readahead, write coalescing nor the cache
+        // policy apply.
+        if (CachePolicy::IsEnabled() && !m_direct && CachePolicy::Applies(ExpectedSize(Oflag, env))) {
+            m_cache_policy.reset(new CachePolicy(m_wrapped->getFD(), (Oflag & O_ACCMODE) == O_RDONLY,
+                                                 CachePolicy::Transfer));
+        }
+        if (Readahead::IsEnabled() && !m_direct) {m_readahead.reset(new Readahead());}
+        if ((Oflag & (O_WRONLY | O_RDWR)) && WriteBuffer::IsEnabled() && !m_direct) {
+            m_write_buffer.reset(new WriteBuffer(*m_wrapped));
+        }
+        fd = getFD();
+    }
 
     if ((Oflag & (O_WRONLY | O_RDWR)) && m_checksum_on_write)
     {
@@ -176,6 +279,101 @@ int     MultiuserFile::Open(const char *path, int Oflag, mode_t Mode, XrdOucEnv
 
 
 
+/*
+ * Reserve the space a client announced for its upload in one go, so large
+ * files are not allocated extent by extent as the writes come in.  Runs with
+ * the user's credentials, which quotas may depend on; file systems without
+ * fallocate support are silently skipped.
+ */
+void MultiuserFile::Preallocate(XrdOucEnv &env)
+{
+    const char *hint = m_prealloc_min ? env.Get("oss.asize") : nullptr;
+    int wrapped_fd = hint ? m_wrapped->getFD() : -1;
+    if (wrapped_fd < 0) {return;}
+
+    char *endptr = NULL;
+    errno = 0;
+    long long size = strtoll(hint, &endptr, 10);
+    if (errno || (endptr && *endptr != '\0') || (size < static_cast<long long>(m_prealloc_min))) {return;}
+
+    if (!fallocate(wrapped_fd, FALLOC_FL_KEEP_SIZE, 0, size)) {
+        m_preallocated = size;
+    } else if ((errno != EOPNOTSUPP) && (errno != ENOSYS)) {
+        m_log.Emsg("Open", "Failed to preallocate", m_fname.c_str(), strerror(errno));
+    }
+}
+
+/*
+ * Serve a read-only open from the descriptor cache, revalidating the entry
+ * as the user if it is due.  Returns false on a miss.
+ */
+bool MultiuserFile::OpenCached(const char *path, const UserSentry &sentry)
+{
+    auto &file_cache = FileCache::Instance();
+    auto entry = file_cache.Get(*m_resolution.m_identity, path);
+    if (!entry) {return false;}
+    if (file_cache.IsStale(*entry)) {
+        char pfn[MAXPATHLEN + 1];
+        if (m_oss->Lfn2Pfn(path, pfn, sizeof(pfn))) {return false;}
+        if (RunAsUser(&sentry, [&] {return file_cache.Revalidate(entry, pfn) ? 1 : 0;}) <= 0) {return false;}
+    }
+    m_wrapped.reset(new CachedFile(tident, entry));
+    fd = getFD();
+    return true;
+}
+
+/*
+ * Open a second, O_DIRECT descriptor for a file matching the
+ * multiuser.directio policy.  Runs with the user's credentials.  If that
+ * fails the file simply uses buffered I/O.
+ */
+void MultiuserFile::OpenDirect(const char *path, int Oflag, XrdOucEnv &env)
+{
+    int wrapped_fd = m_wrapped->getFD();
+    if ((wrapped_fd < 0) || !DirectIO::IsEligible(path, ExpectedSize(Oflag, env))) {return;}
+
+    char pfn[MAXPATHLEN + 1];
+    if (m_oss->Lfn2Pfn(path, pfn, sizeof(pfn))) {return;}
+    std::unique_ptr<DirectIO> direct(new DirectIO());
+    int rc = direct->Open(pfn, wrapped_fd, Oflag & O_ACCMODE);
+    if (rc) {
+        m_log.Emsg("Open", "Direct I/O is not available for", m_fname.c_str(), strerror(-rc));
+        return;
+    }
+    m_direct = std::move(direct);
+}
+
+/*
+ * The size an open file has or, for an upload, will have according to the
+ * client; -1 if unknown.
+ */
+long long MultiuserFile::ExpectedSize(int Oflag, XrdOucEnv &env)
+{
+    int wrapped_fd = m_wrapped->getFD();
+    struct stat st;
+    if ((wrapped_fd < 0) || fstat(wrapped_fd, &st) || !S_ISREG(st.st_mode)) {return -1;}
+    long long size = st.st_size;
+    const char *hint = (Oflag & (O_WRONLY | O_RDWR)) ? env.Get("oss.asize") : nullptr;
+    if (hint) {size = std::max(size, strtoll(hint, NULL, 10));}
+    return size;
+}
+
+/*
+ * Give back preallocated space past the end of a file whose upload ended
+ * short of the announced size.
+ */
+void MultiuserFile::TrimPreallocation()
+{
+    int wrapped_fd = m_wrapped->getFD();
+    struct stat st;
+    if ((wrapped_fd >= 0) && !fstat(wrapped_fd, &st) && (st.st_size < m_preallocated)) {
+        if (fallocate(wrapped_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, st.st_size, m_preallocated - st.st_size)) {
+            m_log.Emsg("Close", "Failed to release the unused preallocation of", m_fname.c_str(), strerror(errno));
+        }
+    }
+    m_preallocated = 0;
+}
+
 ssize_t MultiuserFile::Write(const void *buffer, off_t offset, size_t size)
 {
 
@@ -187,8 +385,14 @@ ssize_t MultiuserFile::Write(const void *buffer, off_t offset, size_t size)
         return -ENOTSUP;
     }
 
-    auto result = m_wrapped->Write(buffer, offset, size);
+    IoPriorityGuard ioprio(m_ioprio, m_log);
+    Throttle(size);
+    ssize_t result;
+    if (m_write_buffer) {result = m_write_buffer->Write(buffer, offset, size);}
+    else if (m_direct) {result = m_direct->Write(*m_wrapped, buffer, offset, size);}
+    else {result = m_wrapped->Write(buffer, offset, size);}
     if (result >= 0) {m_nextoff += result;}
+    if (m_cache_policy && (result > 0)) {m_cache_policy->OnWrite(offset, result);}
     if (m_state)
     {
         m_state->Update(static_cast<const unsigned char*>(buffer), size);
@@ -200,16 +404,27 @@ ssize_t MultiuserFile::Write(const void *buffer, off_t offset, size_t size)
 
 int MultiuserFile::Close(long long *retsz) 
 {
+    IoPriorityGuard ioprio(m_ioprio, m_log);
+    // A buffered write failing here (or earlier) fails the close, since the
+    // client was told those writes succeeded.
+    int flush_result = m_write_buffer ? m_write_buffer->Release() : 0;
+    m_write_buffer.reset();
+    if (m_preallocated) {TrimPreallocation();}
     auto close_result = m_wrapped->Close(retsz);
+    if ((close_result == XrdOssOK) && flush_result) {close_result = flush_result;}
+    fd = -1;
+    m_readahead.reset();
+    m_direct.reset();
+    m_cache_policy.reset();
     if (m_state)
     {
         m_state->Finalize();
         if (close_result == XrdOssOK) {
             // Only write checksum file if close() was successful
             {
-                UserSentry sentry(m_client, m_log);
+                UserSentry sentry(m_client, m_log, UserSentry::Dispatch);
                 if (sentry.IsValid()) {
-                    g_checksum_manager->Set(m_fname.c_str(), *m_state);
+                    RunAsUser(&sentry, [&] {return g_checksum_manager->Set(m_fname.c_str(), *m_state);});
                 }
             }
             
@@ -244,15 +459,15 @@ public:
         if (env) {
             auto client = env->secEnv();
             if (client) {
-                return new UserSentry(client, *m_log);
+                return new UserSentry(client, *m_log, UserSentry::Dispatch);
             } else {
                 // Look up the username in the env
                 auto username = env->Get("request.name");
                 if (username) {
-                    return new UserSentry(username, *m_log);
+                    return new UserSentry(username, *m_log, UserSentry::Dispatch);
                 } else {
                     // Anonymous requests will not have a request.name
-                    return new UserSentry("", *m_log);
+                    return new UserSentry("", *m_log, UserSentry::Dispatch);
                 }
             }
         }
@@ -264,7 +479,7 @@ public:
     {
         std::unique_ptr<UserSentry> sentryPtr(GenerateUserSentry(Cks.envP));
         if (!sentryPtr->IsValid()) return -EACCES;
-        return cksPI.Calc(Xfn, Cks, doSet);
+        return RunAsUser(sentryPtr.get(), [&] {return cksPI.Calc(Xfn, Cks, doSet);});
     }
 
     virtual
@@ -279,7 +494,7 @@ public:
     {
         std::unique_ptr<UserSentry> sentryPtr(GenerateUserSentry(Cks.envP));
         if (!sentryPtr->IsValid()) return -EACCES;
-        return cksPI.Del(Xfn, Cks);
+        return RunAsUser(sentryPtr.get(), [&] {return cksPI.Del(Xfn, Cks);});
     }
 
     virtual
@@ -287,7 +502,7 @@ public:
     {
         std::unique_ptr<UserSentry> sentryPtr(GenerateUserSentry(Cks.envP));
         if (!sentryPtr->IsValid()) return -EACCES;
-        return cksPI.Get(Xfn, Cks);
+        return RunAsUser(sentryPtr.get(), [&] {return cksPI.Get(Xfn, Cks);});
     }
 
     virtual
@@ -295,7 +510,7 @@ public:
     {
         std::unique_ptr<UserSentry> sentryPtr(GenerateUserSentry(Cks.envP));
         if (!sentryPtr->IsValid()) return -EACCES;
-        return cksPI.Set(Xfn, Cks, myTime);
+        return RunAsUser(sentryPtr.get(), [&] {return cksPI.Set(Xfn, Cks, myTime);});
     }
 
     virtual
@@ -303,7 +518,7 @@ public:
     {
         std::unique_ptr<UserSentry> sentryPtr(GenerateUserSentry(Cks.envP));
         if (!sentryPtr->IsValid()) return -EACCES;
-        return cksPI.Ver(Xfn, Cks);
+        return RunAsUser(sentryPtr.get(), [&] {return cksPI.Ver(Xfn, Cks);});
     }
 
     virtual
@@ -316,6 +531,7 @@ public:
     virtual
     char      *List(const char *Xfn, char *Buff, int Blen, char Sep=' ')
     {
+        UserSentry::ResetThreadIdentity(*m_log);
         //std::unique_ptr<UserSentry> sentryPtr(GenerateUserSentry(Cks.envP));
         return cksPI.List(Xfn, Buff, Blen, Sep);
     }
@@ -343,6 +559,9 @@ XrdOss *XrdOssAddStorageSystem2(XrdOss       *curr_oss,
         return nullptr;
     }
 
+    // Persist-on-successful-close removes the file when the client goes away,
+    // from a context without the user's identity; this is unrelated to
+    // asynchronous I/O (see multiuser.aio), so it stays disabled.
     envP->Export("XRDXROOTD_NOPOSC", "1");
 
     try {